@@ -47,6 +47,11 @@ import sys, os, string, datetime
 import types, re
 from contextlib import contextmanager
 
+try:
+    from collections.abc import Mapping
+except ImportError:
+    from collections import Mapping
+
 # P4Exception - some sort of error occurred
 class P4Exception(Exception):
     """Exception thrown by P4 in case of Perforce errors or warnings"""
@@ -75,7 +80,10 @@ class Spec(dict):
         self.__dict__['_Spec__fields'] = fieldmap
     
     def permitted_fields(self):
-        return self.__fields
+        # The field map is shared by every spec of this type, hand out a copy
+        if self.__fields is None:
+            return None
+        return dict(self.__fields)
     
     def __setitem__(self, key, value):
         if not isinstance(value, str) and not isinstance(value, list):
@@ -206,6 +214,14 @@ class Resolver:
 #
 
 class OutputHandler:
+    """Base class for output handlers set with P4.handler.
+    
+    A subclass may also define outputStatBatch(records) and/or
+    outputTextBatch(chunks). They then receive lists of up to
+    P4.handler_batch_size records (1000 if it is not set) instead of
+    outputStat()/outputText() being called for each one; the return
+    value applies to the whole list."""
+    
     REPORT  = 0
     HANDLED = 1
     CANCEL  = 2
@@ -318,7 +334,12 @@ def processFilelog(h):
             r.change = int( h[ "change" ][ n ] )
             r.action = h[ "action" ][ n ]
             r.type = h[ "type" ][ n ]
-            r.time = datetime.datetime.utcfromtimestamp( int( h[ "time" ][ n ]) )
+            # typed mode has already converted the time (to UTC)
+            t = h[ "time" ][ n ]
+            if isinstance( t, datetime.datetime ):
+                r.time = t.replace( tzinfo=None )
+            else:
+                r.time = datetime.datetime.utcfromtimestamp( int( t ) )
             r.user = h[ "user" ][ n ]
             r.client = h[ "client" ][ n ]
             r.desc = h[ "desc" ][ n ]
@@ -372,6 +393,11 @@ class FilelogOutputHandler(OutputHandler):
 
 import P4API
 
+# P4Record (see lazy_records) behaves like a read-only dict. Columnar output
+# and typed values are never lazy, lazy_records has no effect on them.
+
+Mapping.register(P4API.P4Record)
+
 class P4(P4API.P4Adapter):
     """Use this class to communicate with a Perforce server
         
@@ -384,6 +410,16 @@ class P4(P4API.P4Adapter):
         the connect() method.
         
         It is good practice to disconnect() after the program is complete.
+
+        P4.input answers the prompts and forms of the next commands. A string
+        or dict answers every prompt, a list or tuple one prompt per item and
+        any other iterator is advanced once per prompt. Reading P4.input
+        returns what was set, not what is left: used items are not removed.
+
+        With P4.typed set, numeric fields such as revisions, changes and file
+        sizes become ints and epoch times become datetimes in UTC. Values that
+        are not numbers stay strings, so a field can hold both: change is
+        "default" for files opened in the default changelist.
         """
     # Constants useful for exception_level
     # RAISE_ALL:     Errors and Warnings are raised as exceptions (default)
@@ -499,17 +535,27 @@ class P4(P4API.P4Adapter):
     
     def __iterate(self, cmd, *args, **kargs):
         
+        # P4.filter is meant for the records the caller asks for, not for
+        # the list of specs we are about to fetch
+        kargs.setdefault('filter', '')
         specs = self.run(cmd, *args, **kargs)
         if cmd in self.specfields:
             spec = self.specfields[cmd][0]
             field = self.specfields[cmd][1]
             
             # Return a generators (Python iterator object)
-            # On iteration, this will retrieve one spec at a time
-            return ( self.run(spec, '-o', x[field])[0] for x in specs )
+            # On iteration, this will retrieve the specs a batch at a time,
+            # pipelined so that we do not wait for each one in turn
+            return self.__fetch_specs(spec, [ x[field] for x in specs ])
         else:
             raise Exception('Unknown spec list command: %s', cmd)
     
+    def __fetch_specs(self, spec, names, batch=64):
+        for i in range(0, len(names), batch):
+            commands = [ (spec, '-o', name) for name in names[i:i + batch] ]
+            for result in self.run_pipelined(commands, batch):
+                yield result[0]
+    
     def __repr__(self):
         state = "disconnected"
         if self.connected():
@@ -523,20 +569,239 @@ class P4(P4API.P4Adapter):
     identify = classmethod(identify)
     
     def run(self, *args, **kargs):
-        "Generic run method"
+        """Generic run method
+        
+        files=iterable passes the file arguments of a command separately;
+        they are read from the iterable a chunk at a time (chunk=1000 by
+        default) and the command runs once per chunk, like "p4 -x". The
+        results of all chunks are returned as one list."""
+        
+        files = kargs.pop('files', None)
+        chunk = kargs.pop('chunk', None)
+        if chunk is not None and files is None:
+            raise ValueError("chunk requires the file arguments to be passed as files")
+        
         context = {}
         
         for (k,v) in list(kargs.items()):
             context[k] = getattr(self, k)
             setattr(self, k, v)
         
-        result = P4API.P4Adapter.run(self, *self.__flatten(args))
-        
-        for (k,v) in list(context.items()):
-            setattr( self, k, v)
+        try:
+            if files is not None:
+                result = P4API.P4Adapter.run_chunked(self, chunk or 1000, files,
+                                                     *self.__flatten(args))
+            else:
+                result = P4API.P4Adapter.run(self, *self.__flatten(args))
+        finally:
+            for (k,v) in list(context.items()):
+                setattr( self, k, v)
         
         return result
     
+    def run_pipelined(self, commands, window=64, **kargs):
+        """Runs a list of commands and returns a list of their results.
+        
+        Each command is a list or tuple of the command name and its
+        arguments, for example [('files', '//depot/a'), ('files', '//depot/b')].
+        Up to window commands are sent to the server before waiting for
+        their results, which saves a round trip per command. Errors and
+        warnings of all commands are collected as for run()."""
+        
+        context = {}
+        
+        for (k,v) in list(kargs.items()):
+            context[k] = getattr(self, k)
+            setattr(self, k, v)
+        
+        try:
+            return P4API.P4Adapter.run_pipelined(self,
+                [ self.__flatten(c) for c in commands ], window)
+        finally:
+            for (k,v) in list(context.items()):
+                setattr( self, k, v)
+    
+    def run_many(self, commands, connections=4):
+        """Runs independent commands on several connections at once.
+        
+        The commands run on a Pool of up to connections connections with
+        the connection settings of this P4 object, such as port, user,
+        client, password, charset, ticket_file and cwd. The pool is kept
+        for later calls with the same settings and closed by disconnect().
+        The result is a list with one entry per command: the list run()
+        would have returned, or the P4Exception the command raised."""
+        
+        pool = self.__many_pool(connections)
+        return pool.run_many([ self.__flatten(c) for c in commands ], connections)
+    
+    def run_sharded(self, cmd, path, *args, **kargs):
+        """Runs a command over a large depot path split by directory.
+        
+        For a path ending in /..., the command runs once for the files
+        directly below the path and once for each directory listed by
+        'p4 dirs', spread over a temporary Pool of connections connections
+        (default 4). Results are yielded shard by shard in sorted directory
+        order, so the order does not depend on which shard finishes first.
+        
+        Other keyword arguments are settings for the pool connections, for
+        example maxscanrows=100000; maxresults, maxscanrows and maxlocktime
+        default to those of this P4 object and apply to each shard on its
+        own. Warnings, such as an empty shard, are not raised.
+
+        "//..." is split by depot. Any other path is run as it is, on this
+        P4 object, with the same settings."""
+        
+        connections = kargs.pop('connections', 4)
+        args = self.__flatten(args)
+        
+        for limit in ('maxresults', 'maxscanrows', 'maxlocktime'):
+            kargs.setdefault(limit, getattr(self, limit))
+        kargs.setdefault('exception_level', min(self.exception_level, 1))
+        kargs.setdefault('tagged', self.tagged)
+
+        if not path.endswith("/..."):
+            settings = dict( (k, v) for (k, v) in kargs.items()
+                             if k not in self.__connection_settings )
+            for result in self.run(cmd, args, path, **settings):
+                yield result
+            return
+
+        # "//*" lists the depots, there are no files directly below "//"
+        root = path[:-len("/...")]
+        if root == "/":
+            shards = []
+        else:
+            shards = [ root + "/*" ]
+        dirs = self.run_dirs(root + "/*", exception_level=1, tagged=1)
+        shards += [ d + "/..." for d in sorted( d['dir'] for d in dirs ) ]
+        
+        with self.__pool(connections, **kargs) as pool:
+            for i in range(0, len(shards), connections):
+                commands = [ (cmd,) + args + (s,) for s in shards[i:i + connections] ]
+                for results in pool.run_many(commands, connections):
+                    if isinstance(results, Exception):
+                        raise results
+                    for result in results:
+                        yield result
+    
+    # Settings a pool connection needs to talk to the server like this one.
+    # cwd brings back the P4CONFIG file that was in use.
+    __connection_settings = ( 'port', 'user', 'client', 'password', 'charset',
+        'ticket_file', 'host', 'prog', 'version', 'language', 'cwd',
+        'encoding', 'api_level', 'streams', 'track' )
+
+    def __pool_settings(self, **kargs):
+        settings = {}
+        for name in self.__connection_settings:
+            value = getattr(self, name, None)
+            if value is not None and value != "":
+                settings[name] = value
+        settings.update(kargs)
+        return settings
+
+    def __pool(self, connections, **kargs):
+        return Pool(connections, **self.__pool_settings(**kargs))
+
+    # The pool of run_many() lives in the instance dict, P4Adapter only
+    # accepts its own attributes
+    def __many_pool(self, connections):
+        settings = self.__pool_settings()
+        key = (connections, sorted(settings.items()))
+        kept = self.__dict__.get('_P4__many')
+        if kept is not None and kept[0] == key:
+            return kept[1]
+        self.__close_many_pool()
+        pool = Pool(connections, **settings)
+        self.__dict__['_P4__many'] = (key, pool)
+        return pool
+
+    def __close_many_pool(self):
+        kept = self.__dict__.pop('_P4__many', None)
+        if kept is not None:
+            kept[1].close()
+    
+    def run_iter(self, *args, **kargs):
+        """Runs a command and yields its results as they arrive from the server.
+        
+        The command runs in the background and only a limited number of
+        results are buffered ahead of the caller. Errors and warnings are
+        raised once all results have been consumed. No other command can be
+        run on this connection until the iteration has finished or the
+        generator has been closed."""
+        
+        context = {}
+        
+        for (k,v) in list(kargs.items()):
+            context[k] = getattr(self, k)
+            setattr(self, k, v)
+        
+        try:
+            results = P4API.P4Adapter.run_iter(self, *self.__flatten(args))
+            if results is not False:
+                for result in results:
+                    yield result
+        finally:
+            for (k,v) in list(context.items()):
+                setattr( self, k, v)
+    
+    def run_async(self, *args, **kargs):
+        """Runs a command in the background and returns an asyncio future.
+        
+        The command runs on a thread of its own, so the event loop carries
+        on while the server works. The future's result is what run() would
+        have returned; if run() would have raised a P4Exception, so does the
+        future. Cancelling the future asks the server to abandon the command;
+        disconnecting while it runs makes the future raise a P4Exception.
+        
+        Keyword arguments are applied for the duration of the command, as
+        for run(), and restored on the event loop's thread. loop selects the
+        event loop the future belongs to, by default the running one."""
+        
+        import asyncio
+        
+        loop = kargs.pop('loop', None) or asyncio.get_running_loop()
+        future = loop.create_future()
+        context = {}
+        
+        for (k,v) in list(kargs.items()):
+            context[k] = getattr(self, k)
+            setattr(self, k, v)
+        
+        def restore():
+            for (k,v) in list(context.items()):
+                setattr( self, k, v)
+        
+        def settle(result, error):
+            restore()
+            if future.cancelled():
+                return
+            if error is not None:
+                future.set_exception(error)
+            else:
+                future.set_result(result)
+        
+        def done(result, error):
+            # called on the command thread
+            try:
+                loop.call_soon_threadsafe(settle, result, error)
+            except RuntimeError:
+                # the loop is closed, nobody is waiting for the result
+                restore()
+        
+        try:
+            started = P4API.P4Adapter.run_async(self, done, *self.__flatten(args))
+        except:
+            restore()
+            raise
+        
+        if started is False:
+            restore()
+            future.set_result(False)
+        else:
+            future.add_done_callback(lambda f: f.cancelled() and self.cancel())
+        
+        return future
+    
     def run_submit(self, *args, **kargs):
         "Simplified submit - if any arguments is a dict, assume it to be the changeform"
         nargs = list(args)
@@ -572,7 +837,7 @@ class P4(P4API.P4Adapter):
     def run_login(self, *args):
         "Simple interface to make login easier"
         self.input = self.password
-        return self.run("login", *args)
+        return self.run("login", *args, filter="")
     
     def run_password( self, oldpass, newpass ):
         "Simple interface to allow setting of the password"
@@ -599,7 +864,7 @@ class P4(P4API.P4Adapter):
         result = []
         for h in raw:
             df = None
-            if isinstance( h, dict ):
+            if isinstance( h, Mapping ):
                 df = processFilelog( h )
             else:
                 df = h
@@ -611,7 +876,7 @@ class P4(P4API.P4Adapter):
         result = []
         if raw:
             for line in raw:
-                if isinstance(line, dict):
+                if isinstance(line, Mapping):
                     result.append(line)
                     result.append("")
                 else:
@@ -675,6 +940,10 @@ class P4(P4API.P4Adapter):
         P4API.P4Adapter.connect( self )
         return self
     
+    def disconnect( self ):
+        self.__close_many_pool()
+        return P4API.P4Adapter.disconnect( self )
+
     @contextmanager
     def while_tagged( self, t ):
         old = self.tagged
@@ -772,13 +1041,48 @@ class Map(P4API.P4Map):
             right = args[1].strip()
             P4API.P4Map.insert(self, left, right )
 
+class Pool(P4API.P4Pool):
+    """A pool of connected P4 objects that can be shared between threads.
+        
+        Pool(size, **kargs) creates up to size connections when they are
+        needed, each one a P4 object constructed with kargs, for example
+        Pool(8, port="1666", user="bruno").
+        
+        checkout() returns an idle connection, waiting for one to be
+        returned if all of them are in use, and checkin() hands it back.
+        Idle connections dropped by the server are reconnected on checkout.
+        
+        run_many(commands, connections) runs a list of commands, each a
+        tuple of the command name and its arguments, on up to connections
+        threads at once and returns the result or exception of each one.
+        """
+    def __init__(self, size, **kargs):
+        P4API.P4Pool.__init__(self, size, **kargs)
+    
+    @contextmanager
+    def connection( self ):
+        """Checks out a connection for the duration of a with block"""
+        
+        p4 = self.checkout()
+        try:
+            yield p4
+        finally:
+            self.checkin(p4)
+    
+    def __enter__( self ):
+        return self
+    
+    def __exit__( self, exc_type, exc_val, exc_tb ):
+        self.close()
+        return False
+
 if __name__ == "__main__":
     p4 = P4()
     p4.connect()
     try:
         ret = p4.run(sys.argv[1:])
         for line in ret:
-            if isinstance(line, dict):
+            if isinstance(line, Mapping):
                 print("-----")
                 for k in list(line.keys()):
                     print(k, "=", line[k])
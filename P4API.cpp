@@ -54,6 +54,11 @@
 #include "PythonActionMergeData.h"
 #include "P4MapMaker.h"
 #include "PythonMessage.h"
+#include "PythonThreadGuard.h"
+#include "PythonConnectionPool.h"
+#include "PythonResultStream.h"
+#include "PythonRecord.h"
+#include "PythonOutputSink.h"
 #include "PythonTypes.h"
 
 // #include <alloca.h> 
@@ -97,6 +102,7 @@ P4Adapter_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
     P4Adapter *self = (P4Adapter *) type->tp_alloc(type, 0);
     if (self != NULL) {	
 	self->clientAPI = new PythonClientAPI();
+	self->clientAPI->SetOwner((PyObject *) self);
     }
     
     return (PyObject *) self;
@@ -205,6 +211,10 @@ static PyObject * P4Adapter_set_env(P4Adapter * self, PyObject *args)
 }
 
 
+static int GetCommandArgs(PyObject * args, Py_ssize_t first,
+			  vector<const char *> &argv,
+			  vector<PyObject *> &strings);
+
 static PyObject * P4Adapter_run(P4Adapter * self, PyObject * args)
 {
     PyObject * cmd = PyTuple_GetItem(args, 0);
@@ -212,23 +222,270 @@ static PyObject * P4Adapter_run(P4Adapter * self, PyObject * args)
     	return NULL;
     }
     
-    // assume the args are flattened already
-    
+    vector<PyObject *> strings;
     vector<const char *> argv;
-    for (Py_ssize_t i = 1; i < PyTuple_Size(args); ++i) {
+    PyObject * result = NULL;
+
+    argv.reserve(PyTuple_Size(args));
+    if (GetCommandArgs(args, 1, argv, strings) == 0) {
+	// this is a bit of a hack: it assumes the storage layout of the vector is continuous
+	// the other hack is that the API expects (char * const *), but this cannot be stored
+	// a std::vector<>, because it cannot exchange pointers
+
+	result = self->clientAPI->Run(GetPythonString(cmd), argv.size(), 
+	    (argv.size() > 0) ? (char * const *) &argv[0] : NULL );
+    }
+
+    for (size_t i = 0; i < strings.size(); ++i)
+	Py_DECREF(strings[i]);
+
+    return result;
+}
+
+// Converts the command arguments from position first onwards into strings.
+// Any string objects created on the way are added to strings and have to be
+// released by the caller once argv is no longer needed.
+
+static int GetCommandArgs(PyObject * args, Py_ssize_t first,
+			  vector<const char *> &argv,
+			  vector<PyObject *> &strings)
+{
+    // assume the args are flattened already
+
+    for (Py_ssize_t i = first; i < PyTuple_Size(args); ++i) {
 	PyObject * item = PyTuple_GET_ITEM(args, i);
 	if( ! PyBytes_Check(item) ) {
 	    item = PyObject_Str(item);
+	    if (item == NULL)
+		return -1;
+	    strings.push_back(item);
 	}
     	argv.push_back(GetPythonString(item));
     }
-    
-    // this is a bit of a hack: it assumes the storage layout of the vector is continuous
-    // the other hack is that the API expects (char * const *), but this cannot be stored
-    // a std::vector<>, because it cannot exchange pointers
-    
-    return self->clientAPI->Run(GetPythonString(cmd), argv.size(), 
-        (argv.size() > 0) ? (char * const *) &argv[0] : NULL );
+
+    return 0;
+}
+
+// Number of results a streaming command may send ahead of the consumer
+static const int P4ITERATOR_QUEUE = 1000;
+
+static PyObject * P4Adapter_run_iter(P4Adapter * self, PyObject * args)
+{
+    PyObject * cmd = PyTuple_GetItem(args, 0);
+    if (cmd == NULL) {
+    	return NULL;
+    }
+
+    vector<PyObject *> strings;
+    vector<const char *> argv;
+    PyObject * result = NULL;
+
+    if (GetCommandArgs(args, 1, argv, strings) == 0) {
+	P4Iterator * iter = PyObject_New(P4Iterator, &P4IteratorType);
+	if (iter != NULL) {
+	    Py_INCREF(self);
+	    iter->adapter = self;
+	    iter->stream = new PythonResultStream(P4ITERATOR_QUEUE);
+
+	    // the arguments are copied, they are no longer needed afterwards
+
+	    result = self->clientAPI->RunIter(GetPythonString(cmd), argv.size(),
+		(argv.size() > 0) ? (char * const *) &argv[0] : NULL,
+		iter->stream);
+
+	    if (result == Py_True) {
+		Py_DECREF(result);
+		result = (PyObject *) iter;
+	    }
+	    else {
+		Py_DECREF(iter);
+	    }
+	}
+    }
+
+    for (size_t i = 0; i < strings.size(); ++i)
+	Py_DECREF(strings[i]);
+
+    return result;
+}
+
+/*
+ * Runs a command in the background. The first argument is called as
+ * callback(results, exception) on the command thread when it is done.
+ */
+static PyObject * P4Adapter_run_async(P4Adapter * self, PyObject * args)
+{
+    PyObject * callback = PyTuple_GetItem(args, 0);
+    if (callback == NULL) {
+    	return NULL;
+    }
+
+    if (! PyCallable_Check(callback)) {
+	PyErr_SetString(PyExc_TypeError, "First argument needs to be callable");
+	return NULL;
+    }
+
+    PyObject * cmd = PyTuple_GetItem(args, 1);
+    if (cmd == NULL) {
+    	return NULL;
+    }
+
+    vector<PyObject *> strings;
+    vector<const char *> argv;
+    PyObject * result = NULL;
+
+    if (GetCommandArgs(args, 2, argv, strings) == 0) {
+	result = self->clientAPI->RunAsync(GetPythonString(cmd), argv.size(),
+	    (argv.size() > 0) ? (char * const *) &argv[0] : NULL,
+	    callback, (PyObject *) self);
+    }
+
+    for (size_t i = 0; i < strings.size(); ++i)
+	Py_DECREF(strings[i]);
+
+    return result;
+}
+
+// A list of commands, each a sequence of the command name and its arguments,
+// converted into the flat arrays expected by RunPipelined() and RunMany().
+// The strings stay valid for as long as the CommandList exists.
+
+class CommandList
+{
+public:
+    CommandList() : seq(NULL) {}
+
+    ~CommandList()
+    {
+	for (size_t i = 0; i < strings.size(); ++i)
+	    Py_DECREF(strings[i]);
+	for (size_t i = 0; i < tuples.size(); ++i)
+	    Py_DECREF(tuples[i]);
+	Py_XDECREF(seq);
+    }
+
+    int Parse(PyObject * commands, const char * method)
+    {
+	seq = PySequence_Fast(commands, "commands must be a sequence");
+	if (seq == NULL)
+	    return -1;
+
+	Py_ssize_t count = PySequence_Fast_GET_SIZE(seq);
+	vector<size_t> starts;
+
+	for (Py_ssize_t i = 0; i < count; ++i) {
+	    PyObject * t = PySequence_Tuple(PySequence_Fast_GET_ITEM(seq, i));
+	    if (t == NULL)
+		return -1;
+	    tuples.push_back(t);
+
+	    if (PyTuple_GET_SIZE(t) == 0) {
+		StrBuf msg;
+		msg << "Empty command in " << method << "()";
+		PyErr_SetString(PyExc_ValueError, msg.Text());
+		return -1;
+	    }
+
+	    PyObject * cmd = PyTuple_GET_ITEM(t, 0);
+	    if (! PyBytes_Check(cmd)) {
+		cmd = PyObject_Str(cmd);
+		if (cmd == NULL)
+		    return -1;
+		strings.push_back(cmd);
+	    }
+	    cmds.push_back(GetPythonString(cmd));
+
+	    starts.push_back(argv.size());
+	    if (GetCommandArgs(t, 1, argv, strings) < 0)
+		return -1;
+	    argcs.push_back((int) (argv.size() - starts.back()));
+	}
+
+	// argv may have moved while it grew, so build the pointers now
+	argv.push_back(NULL);
+	for (size_t i = 0; i < starts.size(); ++i)
+	    argvs.push_back((char * const *) &argv[starts[i]]);
+
+	return 0;
+    }
+
+    int				Count()	   { return (int) cmds.size(); }
+    const char * const *	Commands() { return cmds.empty() ? NULL : &cmds[0]; }
+    const int *			Argcs()	   { return argcs.empty() ? NULL : &argcs[0]; }
+    char * const * const *	Argvs()	   { return argvs.empty() ? NULL : &argvs[0]; }
+
+private:
+    PyObject *			seq;
+    vector<PyObject *>		tuples;
+    vector<PyObject *>		strings;
+    vector<const char *>	cmds;
+    vector<int>			argcs;
+    vector<const char *>	argv;
+    vector<char * const *>	argvs;
+};
+
+/*
+ * Runs a command once for every chunk file arguments taken from an
+ * iterable, the way "p4 -x" does. Expects the chunk size, the iterable,
+ * the command and its options.
+ */
+static PyObject * P4Adapter_run_chunked(P4Adapter * self, PyObject * args)
+{
+    if (PyTuple_Size(args) < 3) {
+	PyErr_SetString(PyExc_TypeError,
+	    "run_chunked() expects a chunk size, the files and a command");
+	return NULL;
+    }
+
+    long chunk = PyInt_AsLong(PyTuple_GET_ITEM(args, 0));
+    if (chunk == -1 && PyErr_Occurred())
+	return NULL;
+
+    PyObject * files = PyObject_GetIter(PyTuple_GET_ITEM(args, 1));
+    if (files == NULL)
+	return NULL;
+
+    PyObject * cmd = PyTuple_GET_ITEM(args, 2);
+    vector<PyObject *> strings;
+    vector<const char *> argv;
+    PyObject * result = NULL;
+
+    if (GetCommandArgs(args, 3, argv, strings) == 0) {
+	result = self->clientAPI->RunChunked(GetPythonString(cmd), argv.size(),
+	    (argv.size() > 0) ? (char * const *) &argv[0] : NULL,
+	    files, (int) chunk);
+    }
+
+    for (size_t i = 0; i < strings.size(); ++i)
+	Py_DECREF(strings[i]);
+    Py_DECREF(files);
+
+    return result;
+}
+
+/*
+ * Runs a list of commands, each a sequence of the command name and its
+ * arguments, with up to window commands in flight at a time.
+ */
+static PyObject * P4Adapter_run_pipelined(P4Adapter * self, PyObject * args)
+{
+    PyObject * commands;
+    int window = 64;
+
+    if (!PyArg_ParseTuple(args, "O|i", &commands, &window))
+	return NULL;
+
+    CommandList list;
+    if (list.Parse(commands, "run_pipelined") < 0)
+	return NULL;
+
+    return self->clientAPI->RunPipelined(list.Count(), list.Commands(),
+	list.Argcs(), list.Argvs(), window);
+}
+
+static PyObject * P4Adapter_cancel(P4Adapter * self)
+{
+    return self->clientAPI->Cancel();
 }
 
 static PyObject * P4API_identify(PyObject * self)
@@ -268,6 +525,30 @@ static PyObject * P4Adapter_parseSpec(P4Adapter * self, PyObject * args)
     return NULL;
 }
 
+static PyObject * P4Adapter_formatSpecs(P4Adapter * self, PyObject * args)
+{
+    const char * type;
+    PyObject * specs;
+    
+    if ( PyArg_ParseTuple(args, "sO", &type, &specs) ) {
+    	return self->clientAPI->FormatSpecs(type, specs);
+    }
+    
+    return NULL;
+}
+
+static PyObject * P4Adapter_parseSpecs(P4Adapter * self, PyObject * args)
+{
+    const char * type;
+    PyObject * forms;
+    
+    if ( PyArg_ParseTuple(args, "sO", &type, &forms) ) {
+    	return self->clientAPI->ParseSpecs(type, forms);
+    }
+    
+    return NULL;
+}
+
 static PyObject * P4Adapter_protocol(P4Adapter * self, PyObject *args)
 {
     const char * var;
@@ -314,10 +595,24 @@ static PyMethodDef P4Adapter_methods[] = {
      "Set values in the registry (if available on the platform) for the Perforce environment"},
     {"run", (PyCFunction)P4Adapter_run, METH_VARARGS,
      "Runs a command"},
+    {"run_iter", (PyCFunction)P4Adapter_run_iter, METH_VARARGS,
+     "Runs a command in the background and returns an iterator over its results"},
+    {"run_async", (PyCFunction)P4Adapter_run_async, METH_VARARGS,
+     "Runs a command in the background and calls back when it is done"},
+    {"run_chunked", (PyCFunction)P4Adapter_run_chunked, METH_VARARGS,
+     "Runs a command for a few file arguments at a time"},
+    {"run_pipelined", (PyCFunction)P4Adapter_run_pipelined, METH_VARARGS,
+     "Runs several commands without waiting for each of them"},
+    {"cancel", (PyCFunction)P4Adapter_cancel, METH_NOARGS,
+     "Asks the server to abandon the command running in the background"},
     {"format_spec", (PyCFunction)P4Adapter_formatSpec, METH_VARARGS,
      "Converts a dictionary-based form into a string"},
     {"parse_spec", (PyCFunction)P4Adapter_parseSpec, METH_VARARGS,
      "Converts a string form into a dictionary"},
+    {"format_specs", (PyCFunction)P4Adapter_formatSpecs, METH_VARARGS,
+     "Converts a list of dictionary-based forms into strings"},
+    {"parse_specs", (PyCFunction)P4Adapter_parseSpecs, METH_VARARGS,
+     "Converts a list of string forms into dictionaries"},
     {"protocol", (PyCFunction)P4Adapter_protocol, METH_VARARGS,
      "Sets a server protocol variable to the given value or gets the protocol level"}, 
 #if PY_MAJOR_VERSION >= 3
@@ -404,7 +699,7 @@ static int P4Adapter_setattro(P4Adapter *self, PyObject * nameObject, PyObject *
 }
 
 /* PyObject object for the P4Adapter */
-static PyTypeObject P4AdapterType = {
+PyTypeObject P4AdapterType = {
     PyVarObject_HEAD_INIT(&PyType_Type, 0)
     "P4API.P4Adapter",				/* name */
     sizeof(P4Adapter),				/* basicsize */
@@ -977,12 +1272,651 @@ PyTypeObject P4MessageType =
 };
 
 
+// ================
+// ==== P4Pool ====
+// ================
+
+static void
+P4Pool_dealloc(P4Pool *self)
+{
+    delete self->pool;
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/*
+ * P4Pool constructor. Expects the maximum number of connections, any
+ * keyword arguments are passed on to P4.P4() for each new connection.
+ */
+static PyObject *
+P4Pool_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    int size;
+
+    if( !PyArg_ParseTuple(args, "i", &size) )
+	return NULL;
+
+    if( size < 1 ) {
+	PyErr_SetString(PyExc_ValueError, "Pool size must be at least 1");
+	return NULL;
+    }
+
+    PyObject * p4Module = PyImport_ImportModule("P4");
+    if( p4Module == NULL )
+	return NULL;
+
+    PyObject * factory = PyObject_GetAttrString(p4Module, "P4");
+    Py_DECREF(p4Module);
+    if( factory == NULL )
+	return NULL;
+
+    P4Pool *self = (P4Pool *) type->tp_alloc(type, 0);
+    if (self != NULL) {
+	self->pool = new PythonConnectionPool(factory, kwds, size);
+    }
+    Py_DECREF(factory);
+
+    return (PyObject *) self;
+}
+
+static int
+P4Pool_init(P4Pool *self, PyObject *args, PyObject *kwds)
+{
+    // all the work is done in P4Pool_new
+    return 0;
+}
+
+static PyObject *
+P4Pool_repr(P4Pool *self)
+{
+    StrBuf s;
+    s << "P4Pool [size=" << self->pool->GetSize()
+      << " idle=" << self->pool->GetIdle()
+      << " in_use=" << self->pool->GetInUse() << "]";
+    return CreatePythonString(s.Text());
+}
+
+static PyObject *
+P4Pool_checkout(P4Pool *self)
+{
+    return self->pool->Checkout();
+}
+
+static PyObject *
+P4Pool_checkin(P4Pool *self, PyObject * p4)
+{
+    return self->pool->Checkin(p4);
+}
+
+static PyObject *
+P4Pool_close(P4Pool *self)
+{
+    return self->pool->Close();
+}
+
+/*
+ * Runs a list of commands, each a sequence of the command name and its
+ * arguments, on up to connections connections at the same time.
+ */
+static PyObject *
+P4Pool_run_many(P4Pool *self, PyObject * args, PyObject * kwds)
+{
+    static const char * kwlist[] = { "commands", "connections", NULL };
+    PyObject * commands;
+    int connections = 0;
+
+    if( !PyArg_ParseTupleAndKeywords(args, kwds, "O|i", (char **) kwlist,
+				     &commands, &connections) )
+	return NULL;
+
+    CommandList list;
+    if( list.Parse(commands, "run_many") < 0 )
+	return NULL;
+
+    return self->pool->RunMany(list.Count(), list.Commands(), list.Argcs(),
+			       list.Argvs(), connections);
+}
+
+static PyMethodDef P4Pool_methods[] = {
+    {"checkout", (PyCFunction) P4Pool_checkout, METH_NOARGS,
+		"Returns a connected P4 object, waits if all are in use"},
+    {"checkin", (PyCFunction) P4Pool_checkin, METH_O,
+		"Returns a P4 object to the pool"},
+    {"close", (PyCFunction) P4Pool_close, METH_NOARGS,
+		"Disconnects all idle connections and closes the pool"},
+    {"run_many", (PyCFunction) P4Pool_run_many, METH_VARARGS | METH_KEYWORDS,
+		"Runs independent commands on several connections at once"},
+    {NULL}  /* Sentinel */
+};
+
+static PyObject *
+P4Pool_getattro(P4Pool * self, PyObject * nameObject)
+{
+    const char * name = GetPythonString(nameObject);
+
+    if( strcmp(name, "size") == 0) {
+	return PyInt_FromLong( self->pool->GetSize() );
+    }
+    else if( strcmp(name, "idle") == 0) {
+	return PyInt_FromLong( self->pool->GetIdle() );
+    }
+    else if( strcmp(name, "in_use") == 0) {
+	return PyInt_FromLong( self->pool->GetInUse() );
+    }
+    else
+	return PyObject_GenericGetAttr((PyObject *) self, nameObject);
+}
+
+PyTypeObject P4PoolType =
+{
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+	    "P4API.P4Pool",                             /* name */
+	    sizeof(P4Pool),                             /* basicsize */
+	    0,                                          /* itemsize */
+	    (destructor) P4Pool_dealloc,                /* dealloc */
+	    0,                                          /* print */
+	    0,                                          /* getattr */
+	    0,                                          /* setattr */
+	    0,                                          /* compare */
+	    (reprfunc) P4Pool_repr,                     /* repr */
+	    0,                                          /* number methods */
+	    0,                                          /* sequence methods */
+	    0,                                          /* mapping methods */
+	    0,                                          /* tp_hash */
+	    0,                                          /* tp_call*/
+	    0,                                          /* tp_str*/
+	    (getattrofunc) P4Pool_getattro,             /* tp_getattro*/
+	    0,                                          /* tp_setattro*/
+	    0,                                          /* tp_as_buffer*/
+	    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /* tp_flags*/
+	    "P4Pool - pool of connections shared between threads", /* tp_doc */
+	    0,                                          /* tp_traverse */
+	    0,                                          /* tp_clear */
+	    0,                                          /* tp_richcompare */
+	    0,                                          /* tp_weaklistoffset */
+	    0,                                          /* tp_iter */
+	    0,                                          /* tp_iternext */
+	    P4Pool_methods,                             /* tp_methods */
+	    0,                                          /* tp_members */
+	    0,                                          /* tp_getset */
+	    0,                                          /* tp_base */
+	    0,                                          /* tp_dict */
+	    0,                                          /* tp_descr_get */
+	    0,                                          /* tp_descr_set */
+	    0,                                          /* tp_dictoffset */
+	    (initproc) P4Pool_init,                     /* tp_init */
+	    0,                                          /* tp_alloc */
+	    P4Pool_new,                                 /* tp_new */
+};
+
+
+// ================
+// ==== P4Sink ====
+// ================
+
+/*
+ * The native output handlers. P4Sink is the common base type and cannot be
+ * created itself; CountSink, JsonlSink, FieldSetSink and SumSink each
+ * create their PythonOutputSink in tp_new.
+ */
+
+static void
+P4Sink_dealloc(P4Sink *self)
+{
+    delete self->sink;
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject *
+P4Sink_wrap(PyTypeObject *type, PythonOutputSink * sink)
+{
+    P4Sink *self = (P4Sink *) type->tp_alloc(type, 0);
+    if (self != NULL)
+	self->sink = sink;
+    else
+	delete sink;
+
+    return (PyObject *) self;
+}
+
+static PyObject *
+P4CountSink_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    if( !PyArg_ParseTuple(args, "") )
+	return NULL;
+
+    return P4Sink_wrap(type, new PythonCountSink);
+}
+
+static PyObject *
+P4JsonlSink_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    const char * path;
+
+    if( !PyArg_ParseTuple(args, "s", &path) )
+	return NULL;
+
+    FILE * out = fopen(path, "wb");
+    if( !out )
+	return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *) path);
+
+    return P4Sink_wrap(type, new PythonJsonlSink(out));
+}
+
+static PyObject *
+P4FieldSetSink_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    const char * field;
+
+    if( !PyArg_ParseTuple(args, "s", &field) )
+	return NULL;
+
+    return P4Sink_wrap(type, new PythonFieldSetSink(field));
+}
+
+static PyObject *
+P4SumSink_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    const char * field;
+
+    if( !PyArg_ParseTuple(args, "s", &field) )
+	return NULL;
+
+    return P4Sink_wrap(type, new PythonSumSink(field));
+}
+
+static PyObject *
+P4Sink_reset(P4Sink *self)
+{
+    self->sink->Reset();
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+P4Sink_close(P4Sink *self)
+{
+    self->sink->Close();
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef P4Sink_methods[] = {
+    {"reset", (PyCFunction) P4Sink_reset, METH_NOARGS,
+		"Forgets everything collected so far"},
+    {"close", (PyCFunction) P4Sink_close, METH_NOARGS,
+		"Closes the output file of a JsonlSink"},
+    {NULL}  /* Sentinel */
+};
+
+static PyObject *
+P4Sink_getattro(P4Sink * self, PyObject * nameObject)
+{
+    const char * name = GetPythonString(nameObject);
+
+    if( strcmp(name, "result") == 0) {
+	return self->sink->GetResult();
+    }
+    else
+	return PyObject_GenericGetAttr((PyObject *) self, nameObject);
+}
+
+PyTypeObject P4SinkType =
+{
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+	    "P4API.P4Sink",                             /* name */
+	    sizeof(P4Sink),                             /* basicsize */
+	    0,                                          /* itemsize */
+	    (destructor) P4Sink_dealloc,                /* dealloc */
+	    0,                                          /* print */
+	    0,                                          /* getattr */
+	    0,                                          /* setattr */
+	    0,                                          /* compare */
+	    0,                                          /* repr */
+	    0,                                          /* number methods */
+	    0,                                          /* sequence methods */
+	    0,                                          /* mapping methods */
+	    0,                                          /* tp_hash */
+	    0,                                          /* tp_call*/
+	    0,                                          /* tp_str*/
+	    (getattrofunc) P4Sink_getattro,             /* tp_getattro*/
+	    0,                                          /* tp_setattro*/
+	    0,                                          /* tp_as_buffer*/
+	    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /* tp_flags*/
+	    "P4Sink - output handler implemented natively", /* tp_doc */
+	    0,                                          /* tp_traverse */
+	    0,                                          /* tp_clear */
+	    0,                                          /* tp_richcompare */
+	    0,                                          /* tp_weaklistoffset */
+	    0,                                          /* tp_iter */
+	    0,                                          /* tp_iternext */
+	    P4Sink_methods,                             /* tp_methods */
+	    0,                                          /* tp_members */
+	    0,                                          /* tp_getset */
+	    0,                                          /* tp_base */
+	    0,                                          /* tp_dict */
+	    0,                                          /* tp_descr_get */
+	    0,                                          /* tp_descr_set */
+	    0,                                          /* tp_dictoffset */
+	    0,                                          /* tp_init */
+	    0,                                          /* tp_alloc */
+	    0,                                          /* tp_new */
+};
+
+// The concrete sinks only differ in their name and constructor, the rest
+// is inherited from P4SinkType when they are made ready.
+
+static PyTypeObject P4CountSinkType = { PyVarObject_HEAD_INIT(&PyType_Type, 0) };
+static PyTypeObject P4JsonlSinkType = { PyVarObject_HEAD_INIT(&PyType_Type, 0) };
+static PyTypeObject P4FieldSetSinkType = { PyVarObject_HEAD_INIT(&PyType_Type, 0) };
+static PyTypeObject P4SumSinkType = { PyVarObject_HEAD_INIT(&PyType_Type, 0) };
+
+static int
+P4Sink_ready(PyTypeObject * type, const char * name, const char * doc,
+	     newfunc constructor)
+{
+    type->tp_name = name;
+    type->tp_basicsize = sizeof(P4Sink);
+    type->tp_flags = Py_TPFLAGS_DEFAULT;
+    type->tp_doc = doc;
+    type->tp_base = &P4SinkType;
+    type->tp_new = constructor;
+
+    return PyType_Ready(type);
+}
+
+// ====================
+// ==== P4Iterator ====
+// ====================
+
+static void
+P4Iterator_dealloc(P4Iterator *self)
+{
+    // Stops the command if the results were not consumed completely.
+    // Any exception raised while reconnecting is of no use to anybody.
+
+    PyObject *type, *value, *traceback;
+    PyErr_Fetch(&type, &value, &traceback);
+    self->adapter->clientAPI->IterClose(self->stream);
+    PyErr_Restore(type, value, traceback);
+
+    delete self->stream;
+    Py_DECREF(self->adapter);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject *
+P4Iterator_next(P4Iterator *self)
+{
+    return self->adapter->clientAPI->IterNext(self->stream);
+}
+
+static PyObject *
+P4Iterator_close(P4Iterator *self)
+{
+    self->adapter->clientAPI->IterClose(self->stream);
+    if( PyErr_Occurred() )
+	return NULL;
+
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef P4Iterator_methods[] = {
+    {"close", (PyCFunction) P4Iterator_close, METH_NOARGS,
+		"Stops the command and discards the remaining results"},
+    {NULL}  /* Sentinel */
+};
+
+PyTypeObject P4IteratorType =
+{
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+	    "P4API.P4Iterator",                         /* name */
+	    sizeof(P4Iterator),                         /* basicsize */
+	    0,                                          /* itemsize */
+	    (destructor) P4Iterator_dealloc,            /* dealloc */
+	    0,                                          /* print */
+	    0,                                          /* getattr */
+	    0,                                          /* setattr */
+	    0,                                          /* compare */
+	    0,                                          /* repr */
+	    0,                                          /* number methods */
+	    0,                                          /* sequence methods */
+	    0,                                          /* mapping methods */
+	    0,                                          /* tp_hash */
+	    0,                                          /* tp_call*/
+	    0,                                          /* tp_str*/
+	    0,                                          /* tp_getattro*/
+	    0,                                          /* tp_setattro*/
+	    0,                                          /* tp_as_buffer*/
+	    Py_TPFLAGS_DEFAULT,                         /* tp_flags*/
+	    "P4Iterator - results of a command as they arrive", /* tp_doc */
+	    0,                                          /* tp_traverse */
+	    0,                                          /* tp_clear */
+	    0,                                          /* tp_richcompare */
+	    0,                                          /* tp_weaklistoffset */
+	    PyObject_SelfIter,                          /* tp_iter */
+	    (iternextfunc) P4Iterator_next,             /* tp_iternext */
+	    P4Iterator_methods,                         /* tp_methods */
+	    0,                                          /* tp_members */
+	    0,                                          /* tp_getset */
+	    0,                                          /* tp_base */
+	    0,                                          /* tp_dict */
+	    0,                                          /* tp_descr_get */
+	    0,                                          /* tp_descr_set */
+	    0,                                          /* tp_dictoffset */
+	    0,                                          /* tp_init */
+	    0,                                          /* tp_alloc */
+	    0,                                          /* tp_new */
+};
+
+
+// ==================
+// ==== P4Record ====
+// ==================
+
+static void
+P4Record_dealloc(P4Record *self)
+{
+    delete self->record;
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject *
+P4Record_repr(P4Record *self)
+{
+    PyObject * dict = self->record->GetDict();
+    if( dict == NULL )
+	return NULL;
+
+    return PyObject_Repr(dict);
+}
+
+static Py_ssize_t
+P4Record_length(P4Record *self)
+{
+    PyObject * dict = self->record->GetDict();
+    if( dict == NULL )
+	return -1;
+
+    return PyDict_Size(dict);
+}
+
+static PyObject *
+P4Record_subscript(P4Record *self, PyObject * key)
+{
+    return self->record->GetItem(key);
+}
+
+static int
+P4Record_contains(P4Record *self, PyObject * key)
+{
+    return self->record->Contains(key);
+}
+
+static PyObject *
+P4Record_iter(P4Record *self)
+{
+    PyObject * dict = self->record->GetDict();
+    if( dict == NULL )
+	return NULL;
+
+    return PyObject_GetIter(dict);
+}
+
+static PyObject *
+P4Record_richcompare(P4Record *self, PyObject * other, int op)
+{
+    PyObject * dict = self->record->GetDict();
+    if( dict == NULL )
+	return NULL;
+
+    if( PyObject_TypeCheck(other, &P4RecordType) ) {
+	other = ((P4Record *) other)->record->GetDict();
+	if( other == NULL )
+	    return NULL;
+    }
+
+    return PyObject_RichCompare(dict, other, op);
+}
+
+// keys(), values() and items() return whatever dict returns
+
+static PyObject *
+P4Record_dict_method(P4Record *self, const char * method)
+{
+    PyObject * dict = self->record->GetDict();
+    if( dict == NULL )
+	return NULL;
+
+    return PyObject_CallMethod(dict, (char *) method, NULL);
+}
+
+static PyObject *
+P4Record_keys(P4Record *self)
+{
+    return P4Record_dict_method(self, "keys");
+}
+
+static PyObject *
+P4Record_values(P4Record *self)
+{
+    return P4Record_dict_method(self, "values");
+}
+
+static PyObject *
+P4Record_items(P4Record *self)
+{
+    return P4Record_dict_method(self, "items");
+}
+
+static PyObject *
+P4Record_copy(P4Record *self)
+{
+    PyObject * dict = self->record->GetDict();
+    if( dict == NULL )
+	return NULL;
+
+    return PyDict_Copy(dict);
+}
+
+static PyObject *
+P4Record_get(P4Record *self, PyObject * args)
+{
+    PyObject * key;
+    PyObject * def = Py_None;
+
+    if( !PyArg_ParseTuple(args, "O|O", &key, &def) )
+	return NULL;
+
+    PyObject * result = self->record->GetItem(key);
+    if( result == NULL && PyErr_ExceptionMatches(PyExc_KeyError) ) {
+	PyErr_Clear();
+	Py_INCREF(def);
+	result = def;
+    }
+
+    return result;
+}
+
+static PyMethodDef P4Record_methods[] = {
+    {"keys", (PyCFunction) P4Record_keys, METH_NOARGS,
+		"Returns the keys of the record"},
+    {"values", (PyCFunction) P4Record_values, METH_NOARGS,
+		"Returns the values of the record"},
+    {"items", (PyCFunction) P4Record_items, METH_NOARGS,
+		"Returns the (key, value) pairs of the record"},
+    {"get", (PyCFunction) P4Record_get, METH_VARARGS,
+		"Returns the value for key if present, otherwise the default"},
+    {"copy", (PyCFunction) P4Record_copy, METH_NOARGS,
+		"Returns the record as a new dict"},
+    {NULL}  /* Sentinel */
+};
+
+static PyMappingMethods P4Record_as_mapping = {
+	    (lenfunc) P4Record_length,                  /* mp_length */
+	    (binaryfunc) P4Record_subscript,            /* mp_subscript */
+	    0,                                          /* mp_ass_subscript */
+};
+
+static PySequenceMethods P4Record_as_sequence = {
+	    0,                                          /* sq_length */
+	    0,                                          /* sq_concat */
+	    0,                                          /* sq_repeat */
+	    0,                                          /* sq_item */
+	    0,                                          /* sq_slice */
+	    0,                                          /* sq_ass_item */
+	    0,                                          /* sq_ass_slice */
+	    (objobjproc) P4Record_contains,             /* sq_contains */
+};
+
+PyTypeObject P4RecordType =
+{
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+	    "P4API.P4Record",                           /* name */
+	    sizeof(P4Record),                           /* basicsize */
+	    0,                                          /* itemsize */
+	    (destructor) P4Record_dealloc,              /* dealloc */
+	    0,                                          /* print */
+	    0,                                          /* getattr */
+	    0,                                          /* setattr */
+	    0,                                          /* compare */
+	    (reprfunc) P4Record_repr,                   /* repr */
+	    0,                                          /* number methods */
+	    &P4Record_as_sequence,                      /* sequence methods */
+	    &P4Record_as_mapping,                       /* mapping methods */
+	    0,                                          /* tp_hash */
+	    0,                                          /* tp_call*/
+	    0,                                          /* tp_str*/
+	    0,                                          /* tp_getattro*/
+	    0,                                          /* tp_setattro*/
+	    0,                                          /* tp_as_buffer*/
+	    Py_TPFLAGS_DEFAULT,                         /* tp_flags*/
+	    "P4Record - read-only tagged output, converted on access", /* tp_doc */
+	    0,                                          /* tp_traverse */
+	    0,                                          /* tp_clear */
+	    (richcmpfunc) P4Record_richcompare,         /* tp_richcompare */
+	    0,                                          /* tp_weaklistoffset */
+	    (getiterfunc) P4Record_iter,                /* tp_iter */
+	    0,                                          /* tp_iternext */
+	    P4Record_methods,                           /* tp_methods */
+	    0,                                          /* tp_members */
+	    0,                                          /* tp_getset */
+	    0,                                          /* tp_base */
+	    0,                                          /* tp_dict */
+	    0,                                          /* tp_descr_get */
+	    0,                                          /* tp_descr_set */
+	    0,                                          /* tp_dictoffset */
+	    0,                                          /* tp_init */
+	    0,                                          /* tp_alloc */
+	    0,                                          /* tp_new */
+};
+
+
 // ===============
 // ==== P4API ====
 // ===============
 
 struct P4API_state {
         PyObject * error;
+        PyObject * fromTimestamp;	// typed epoch times, see SpecMgr
+        PyObject * utc;
 };
 
 #if PY_MAJOR_VERSION >= 3
@@ -1006,14 +1940,24 @@ static struct PyMethodDef P4API_methods[] = {
 
 static int P4API_traverse(PyObject *m, visitproc visit, void *arg) {
     Py_VISIT(GETSTATE(m)->error);
+    Py_VISIT(GETSTATE(m)->fromTimestamp);
+    Py_VISIT(GETSTATE(m)->utc);
     return 0;
 }
 
 static int P4API_clear(PyObject *m) {
     Py_CLEAR(GETSTATE(m)->error);
+    SpecMgr::SetTimeConverter(NULL, NULL);
+    Py_CLEAR(GETSTATE(m)->fromTimestamp);
+    Py_CLEAR(GETSTATE(m)->utc);
     return 0;
 }
 
+static void P4API_free(void *m) {
+    SpecMgr::FreeServers();
+    SpecMgr::FreeDefaults();
+}
+
 static struct PyModuleDef P4API_moduledef = {
         PyModuleDef_HEAD_INIT,
         "P4API",
@@ -1023,7 +1967,7 @@ static struct PyModuleDef P4API_moduledef = {
         NULL,
         P4API_traverse,
         P4API_clear,
-        NULL
+        P4API_free
 };
 
 #define INITERROR return NULL
@@ -1040,9 +1984,34 @@ initP4API(void)
 #endif
 
 {
+#if PY_VERSION_HEX < 0x03070000
+    // run_iter() calls back into Python from a thread of its own
+    PyEval_InitThreads();
+#endif
+
     if (PyType_Ready(&P4AdapterType) < 0) 
 	INITERROR;
 
+    if (PyType_Ready(&P4PoolType) < 0)
+	INITERROR;
+
+    if (PyType_Ready(&P4IteratorType) < 0)
+	INITERROR;
+
+    if (PyType_Ready(&P4RecordType) < 0)
+	INITERROR;
+
+    if (PyType_Ready(&P4SinkType) < 0 ||
+	P4Sink_ready(&P4CountSinkType, "P4API.CountSink",
+		"CountSink() - counts the tagged records", P4CountSink_new) < 0 ||
+	P4Sink_ready(&P4JsonlSinkType, "P4API.JsonlSink",
+		"JsonlSink(path) - writes each record as a line of JSON", P4JsonlSink_new) < 0 ||
+	P4Sink_ready(&P4FieldSetSinkType, "P4API.FieldSetSink",
+		"FieldSetSink(field) - collects the distinct values of a field", P4FieldSetSink_new) < 0 ||
+	P4Sink_ready(&P4SumSinkType, "P4API.SumSink",
+		"SumSink(field) - adds up the integer values of a field", P4SumSink_new) < 0)
+	INITERROR;
+
 #if PY_MAJOR_VERSION >= 3
     PyObject * module = PyModule_Create(&P4API_moduledef);
 #else
@@ -1066,6 +2035,27 @@ initP4API(void)
     Py_INCREF(&P4MessageType);
     PyModule_AddObject(module, "P4Message", (PyObject*) &P4MessageType);
 
+    Py_INCREF(&P4PoolType);
+    PyModule_AddObject(module, "P4Pool", (PyObject*) &P4PoolType);
+
+    Py_INCREF(&P4RecordType);
+    PyModule_AddObject(module, "P4Record", (PyObject*) &P4RecordType);
+
+    Py_INCREF(&P4SinkType);
+    PyModule_AddObject(module, "P4Sink", (PyObject*) &P4SinkType);
+
+    Py_INCREF(&P4CountSinkType);
+    PyModule_AddObject(module, "CountSink", (PyObject*) &P4CountSinkType);
+
+    Py_INCREF(&P4JsonlSinkType);
+    PyModule_AddObject(module, "JsonlSink", (PyObject*) &P4JsonlSinkType);
+
+    Py_INCREF(&P4FieldSetSinkType);
+    PyModule_AddObject(module, "FieldSetSink", (PyObject*) &P4FieldSetSinkType);
+
+    Py_INCREF(&P4SumSinkType);
+    PyModule_AddObject(module, "SumSink", (PyObject*) &P4SumSinkType);
+
     struct P4API_state *st = GETSTATE(module);
 
     st->error = PyErr_NewException((char *)"P4API.Error", NULL, NULL);
@@ -1108,6 +2098,27 @@ initP4API(void)
         INITERROR;
     }
 
+    // Epoch times become datetimes in UTC: timezone aware on Python 3,
+    // naive as from utcfromtimestamp() on Python 2
+    PyObject * datetime = PyImport_ImportModule("datetime");
+    PyObject * cls = datetime ? PyObject_GetAttrString(datetime, "datetime") : NULL;
+#if PY_MAJOR_VERSION >= 3
+    PyObject * tz = datetime ? PyObject_GetAttrString(datetime, "timezone") : NULL;
+    st->utc = tz ? PyObject_GetAttrString(tz, "utc") : NULL;
+    st->fromTimestamp = cls && st->utc ? PyObject_GetAttrString(cls, "fromtimestamp") : NULL;
+    Py_XDECREF(tz);
+#else
+    st->utc = NULL;
+    st->fromTimestamp = cls ? PyObject_GetAttrString(cls, "utcfromtimestamp") : NULL;
+#endif
+    Py_XDECREF(cls);
+    Py_XDECREF(datetime);
+    if (!st->fromTimestamp) {
+        Py_DECREF(module);
+        INITERROR;
+    }
+    SpecMgr::SetTimeConverter(st->fromTimestamp, st->utc);
+
 #if PY_MAJOR_VERSION >= 3
     return module;
 #endif
@@ -0,0 +1,381 @@
+/*
+ * P4RecordFilter. Predicates on tagged output records.
+ *
+ * Copyright (c) 2013, Perforce Software, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL PERFORCE SOFTWARE, INC. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id: //depot/r13.1/p4-python/P4RecordFilter.cpp#1 $
+ *
+ */
+
+/*******************************************************************************
+ * Name		: P4RecordFilter.cpp
+ *
+ * Description	: Recursive descent parser and evaluator for the record
+ * 		  predicates described in P4RecordFilter.h. The compiled
+ * 		  expression is a vector of nodes referring to each other
+ * 		  by index.
+ *
+ ******************************************************************************/
+
+#include <Python.h>
+#include "undefdups.h"
+#include <clientapi.h>
+
+#include "P4RecordFilter.h"
+
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <cerrno>
+
+using namespace std;
+
+P4RecordFilter::P4RecordFilter()
+    :	root( -1 ),
+	pos( 0 ),
+	token( T_END ),
+	tokenOp( OP_EQ ),
+	error( 0 )
+{
+}
+
+P4RecordFilter::~P4RecordFilter()
+{
+    for( size_t i = 0; i < nodes.size(); i++ )
+	delete nodes[ i ];
+}
+
+void P4RecordFilter::AddFields( StrBuf & list )
+{
+    for( size_t i = 0; i < nodes.size(); i++ )
+    {
+	const StrBuf & f = nodes[ i ]->field;
+	if( !f.Length() )
+	    continue;
+
+	StrBuf	all, one;
+	all << "," << list << ",";
+	one << "," << f << ",";
+	if( strstr( all.Text(), one.Text() ) )
+	    continue;
+
+	if( list.Length() )
+	    list << ",";
+	list << f;
+    }
+}
+
+int P4RecordFilter::Compile( const char * expr, StrBuf & err )
+{
+    text.Set( expr );
+    pos = text.Text();
+    error = &err;
+
+    Next();
+    root = ParseOr();
+
+    if( root >= 0 && token != T_END )
+    {
+	if( token != T_ERROR )
+	    err << "unexpected '" << tokenText << "'";
+	root = -1;
+    }
+
+    if( root < 0 && !err.Length() )
+	err << "invalid expression";
+
+    error = 0;
+    return root < 0 ? -1 : 0;
+}
+
+//
+// Parser
+//
+
+P4RecordFilter::Token P4RecordFilter::Next()
+{
+    while( isspace( (unsigned char) *pos ) )
+	pos++;
+
+    tokenText.Clear();
+
+    if( !*pos )
+	return token = T_END;
+
+    if( *pos == '(' || *pos == ')' )
+    {
+	tokenText.Extend( *pos );
+	tokenText.Terminate();
+	return token = *pos++ == '(' ? T_LPAREN : T_RPAREN;
+    }
+
+    if( *pos == '"' || *pos == '\'' )
+    {
+	char quote = *pos++;
+	while( *pos && *pos != quote )
+	{
+	    if( *pos == '\\' && pos[ 1 ] )
+		pos++;
+	    tokenText.Extend( *pos++ );
+	}
+	tokenText.Terminate();
+
+	if( !*pos )
+	{
+	    *error << "unterminated string";
+	    return token = T_ERROR;
+	}
+	pos++;
+	return token = T_STRING;
+    }
+
+    static const struct { const char * text; Token token; Op op; } ops[] = {
+	{ "==", T_OP, OP_EQ },		{ "!=", T_OP, OP_NE },
+	{ "<=", T_OP, OP_LE },		{ ">=", T_OP, OP_GE },
+	{ "^=", T_OP, OP_PREFIX },	{ "=~", T_OP, OP_GLOB },
+	{ "&&", T_AND, OP_AND },	{ "||", T_OR, OP_OR },
+	{ "<", T_OP, OP_LT },		{ ">", T_OP, OP_GT },
+	{ "=", T_OP, OP_EQ },		{ "!", T_NOT, OP_NOT },
+	{ 0, T_END, OP_EQ }
+    };
+
+    for( int i = 0; ops[ i ].text; i++ )
+    {
+	size_t len = strlen( ops[ i ].text );
+	if( !strncmp( pos, ops[ i ].text, len ) )
+	{
+	    pos += len;
+	    tokenText.Set( ops[ i ].text );
+	    tokenOp = ops[ i ].op;
+	    return token = ops[ i ].token;
+	}
+    }
+
+    while( *pos && !isspace( (unsigned char) *pos ) && !strchr( "()<>=!&|^\"'", *pos ) )
+	tokenText.Extend( *pos++ );
+    tokenText.Terminate();
+
+    if( !tokenText.Length() )
+    {
+	*error << "unexpected '" << pos << "'";
+	return token = T_ERROR;
+    }
+
+    if( !strcmp( tokenText.Text(), "and" ) ) return token = T_AND;
+    if( !strcmp( tokenText.Text(), "or" ) )  return token = T_OR;
+    if( !strcmp( tokenText.Text(), "not" ) ) return token = T_NOT;
+
+    return token = T_WORD;
+}
+
+int P4RecordFilter::NewNode( Op op, int left, int right )
+{
+    Node * n = new Node;
+    n->op = op;
+    n->left = left;
+    n->right = right;
+    n->numeric = 0;
+    n->number = 0;
+    nodes.push_back( n );
+    return (int) nodes.size() - 1;
+}
+
+int P4RecordFilter::ParseOr()
+{
+    int left = ParseAnd();
+    while( left >= 0 && token == T_OR )
+    {
+	Next();
+	int right = ParseAnd();
+	left = right < 0 ? -1 : NewNode( OP_OR, left, right );
+    }
+    return left;
+}
+
+int P4RecordFilter::ParseAnd()
+{
+    int left = ParseNot();
+    while( left >= 0 && token == T_AND )
+    {
+	Next();
+	int right = ParseNot();
+	left = right < 0 ? -1 : NewNode( OP_AND, left, right );
+    }
+    return left;
+}
+
+int P4RecordFilter::ParseNot()
+{
+    if( token == T_NOT )
+    {
+	Next();
+	int operand = ParseNot();
+	return operand < 0 ? -1 : NewNode( OP_NOT, operand, -1 );
+    }
+
+    if( token == T_LPAREN )
+    {
+	Next();
+	int inner = ParseOr();
+	if( inner < 0 )
+	    return -1;
+	if( token != T_RPAREN )
+	{
+	    *error << "missing ')'";
+	    return -1;
+	}
+	Next();
+	return inner;
+    }
+
+    if( token != T_WORD )
+    {
+	if( token == T_END )
+	    *error << "unexpected end of expression";
+	else if( token != T_ERROR )
+	    *error << "expected a field name, found '" << tokenText << "'";
+	return -1;
+    }
+
+    int n = NewNode( OP_EXISTS, -1, -1 );
+    nodes[ n ]->field = tokenText;
+
+    if( Next() != T_OP )
+	return n;
+
+    nodes[ n ]->op = tokenOp;
+    Next();
+
+    if( token != T_WORD && token != T_STRING )
+    {
+	if( token != T_ERROR )
+	    *error << "expected a value after '" << nodes[ n ]->field << "'";
+	return -1;
+    }
+
+    Node * node = nodes[ n ];
+    node->value = tokenText;
+    node->numeric = token == T_WORD && IsInteger( node->value.Text(), node->number );
+    Next();
+
+    return n;
+}
+
+//
+// Evaluation
+//
+
+int P4RecordFilter::Eval( int i, StrDict * values )
+{
+    if( i < 0 )
+	return 1;
+
+    Node * n = nodes[ i ];
+
+    switch( n->op )
+    {
+    case OP_OR:		return Eval( n->left, values ) || Eval( n->right, values );
+    case OP_AND:	return Eval( n->left, values ) && Eval( n->right, values );
+    case OP_NOT:	return !Eval( n->left, values );
+    case OP_EXISTS:	return values->GetVar( n->field ) != 0;
+    default:		return Compare( n, values->GetVar( n->field ) );
+    }
+}
+
+int P4RecordFilter::Compare( Node * n, const StrPtr * v )
+{
+    if( !v )
+	return n->op == OP_NE;
+
+    if( n->op == OP_PREFIX )
+	return !strncmp( v->Text(), n->value.Text(), n->value.Length() );
+
+    if( n->op == OP_GLOB )
+	return Glob( n->value.Text(), v->Text() );
+
+    long long	number;
+    int		c;
+
+    if( n->numeric && IsInteger( v->Text(), number ) )
+	c = number < n->number ? -1 : number > n->number;
+    else
+	c = strcmp( v->Text(), n->value.Text() );
+
+    switch( n->op )
+    {
+    case OP_EQ:	return c == 0;
+    case OP_NE:	return c != 0;
+    case OP_LT:	return c < 0;
+    case OP_LE:	return c <= 0;
+    case OP_GT:	return c > 0;
+    case OP_GE:	return c >= 0;
+    default:	return 0;
+    }
+}
+
+int P4RecordFilter::IsInteger( const char * s, long long & n )
+{
+    if( !*s )
+	return 0;
+
+    char * end;
+    errno = 0;
+    n = strtoll( s, &end, 10 );
+
+    return !*end && !errno;
+}
+
+// '*' matches any run of characters, '?' any single one
+
+int P4RecordFilter::Glob( const char * p, const char * t )
+{
+    const char * star = 0;
+    const char * mark = 0;
+
+    while( *t )
+    {
+	if( *p == '?' || ( *p && *p != '*' && *p == *t ) )
+	{
+	    p++;
+	    t++;
+	}
+	else if( *p == '*' )
+	{
+	    star = p++;
+	    mark = t;
+	}
+	else if( star )
+	{
+	    p = star + 1;
+	    t = ++mark;
+	}
+	else
+	    return 0;
+    }
+
+    while( *p == '*' )
+	p++;
+
+    return !*p;
+}
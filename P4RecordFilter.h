@@ -0,0 +1,119 @@
+/*
+ * P4RecordFilter. Predicates on tagged output records.
+ *
+ * Copyright (c) 2013, Perforce Software, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL PERFORCE SOFTWARE, INC. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id: //depot/r13.1/p4-python/P4RecordFilter.h#1 $
+ *
+ */
+
+/*******************************************************************************
+ * Name		: P4RecordFilter.h
+ *
+ * Description	: Compiles a small predicate language once and evaluates it
+ * 		  against the StrDict of each tagged record, so that records
+ * 		  which are not wanted never become Python objects.
+ *
+ * 		  expr	  := term { ( "or" | "||" ) term }
+ * 		  term	  := factor { ( "and" | "&&" ) factor }
+ * 		  factor  := ( "not" | "!" ) factor | "(" expr ")"
+ * 		  	   | field [ op value ]
+ * 		  op	  := "==" | "!=" | "<" | "<=" | ">" | ">="
+ * 		  	   | "^=" (prefix) | "=~" (glob with * and ?)
+ *
+ * 		  A field on its own tests whether the record has it. Values
+ * 		  are bare words or quoted strings; when both the value and
+ * 		  the field are integers they are compared as numbers. A
+ * 		  missing field only satisfies "!=", so an "fstat -T" of your
+ * 		  own has to ask for the fields the filter uses.
+ *
+ ******************************************************************************/
+
+#ifndef P4RECORDFILTER_H_
+#define P4RECORDFILTER_H_
+
+#include <vector>
+
+class P4RecordFilter
+{
+public:
+    P4RecordFilter();
+    ~P4RecordFilter();
+
+    // Returns 0 on success, otherwise -1 with the reason in error
+    int		Compile( const char * expr, StrBuf & error );
+
+    // Needs no Python objects and may be called without the GIL
+    int		Match( StrDict * values )	{ return Eval( root, values ); }
+
+    const char *	GetText()	{ return text.Text(); }
+
+    // Adds the fields the filter looks at to a comma separated list
+    void	AddFields( StrBuf & list );
+
+private:
+    enum Op {
+	OP_OR, OP_AND, OP_NOT, OP_EXISTS,
+	OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE, OP_PREFIX, OP_GLOB
+    };
+
+    struct Node {
+	Op		op;
+	int		left;
+	int		right;
+	StrBuf		field;
+	StrBuf		value;
+	int		numeric;	// value is an integer
+	long long	number;
+    };
+
+    enum Token { T_END, T_WORD, T_STRING, T_OP, T_LPAREN, T_RPAREN,
+		 T_AND, T_OR, T_NOT, T_ERROR };
+
+    Token	Next();
+    int		ParseOr();
+    int		ParseAnd();
+    int		ParseNot();
+    int		NewNode( Op op, int left, int right );
+
+    int		Eval( int node, StrDict * values );
+    int		Compare( Node * n, const StrPtr * v );
+
+    static int	IsInteger( const char * s, long long & n );
+    static int	Glob( const char * pattern, const char * text );
+
+private:
+    std::vector<Node *>	nodes;
+    int			root;
+    StrBuf		text;
+
+    // Parser state
+    const char *	pos;
+    Token		token;
+    StrBuf		tokenText;
+    Op			tokenOp;
+    StrBuf *		error;
+};
+
+#endif /* P4RECORDFILTER_H_ */
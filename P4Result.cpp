@@ -36,19 +36,39 @@ $Id: //depot/r13.1/p4-python/P4Result.cpp#1 $
 #include "P4Result.h"
 #include "PythonMessage.h"
 #include "P4PythonDebug.h"
+#include "PythonThreadGuard.h"
+#include "PythonResultStream.h"
 #include "PythonTypes.h"
 
 #include <iostream>
+#include <vector>
+#include <cerrno>
+#include <cctype>
+#include <cstdlib>
 
 using namespace std;
 
+// Typed columns use the widest integer the array module offers
+
+#if PY_MAJOR_VERSION >= 3
+typedef long long ColumnInt;
+#define COLUMN_TYPECODE "q"
+#else
+typedef long ColumnInt;
+#define COLUMN_TYPECODE "l"
+#endif
+
 P4Result::P4Result(SpecMgr * s)
     : output(NULL),
       warnings(NULL),
       errors(NULL),
       messages(NULL),
       track(NULL),
+      columns(NULL),
+      rows(0),
       specMgr(s),
+      stream(NULL),
+      columnar(0),
       fatal(false)
 {
     apiLevel = atoi( P4Tag::l_client );
@@ -74,15 +94,49 @@ P4Result::~P4Result()
 
     if (track)
 	Py_DECREF(track);
+
+    Py_XDECREF(columns);
 }
 
 PyObject * P4Result::GetOutput()
 {   
+    // Commands without tagged rows keep their usual output
+    if (columnar && output && columns && rows > 0) {
+	if (columnar > 1) {
+	    PyObject * key;
+	    PyObject * list;
+	    Py_ssize_t pos = 0;
+
+	    while (PyDict_Next(columns, &pos, &key, &list)) {
+		PyObject * typed = TypedColumn(list);
+		if (typed) {
+		    // replacing the value of an existing key is safe
+		    PyDict_SetItem(columns, key, typed);
+		    Py_DECREF(typed);
+		}
+	    }
+	}
+
+	PyList_Insert(output, 0, columns);
+	Py_CLEAR(columns);
+    }
+
     PyObject * temp = output;
     output = NULL;  // last reference is removed by caller
     return temp;
 }
 
+PyObject * P4Result::TakeOutput()
+{
+    PyObject * temp = GetOutput();
+
+    output = PyList_New(0);
+    Py_CLEAR(columns);
+    rows = 0;
+
+    return temp;
+}
+
 void
 P4Result::Reset()
 {
@@ -104,6 +158,9 @@ P4Result::Reset()
 	Py_DECREF(track);
     track = PyList_New(0);
 
+    Py_CLEAR(columns);
+    rows = 0;
+
     if (output == NULL
 	    || warnings == NULL
 	    || errors == NULL
@@ -130,7 +187,11 @@ int P4Result::AppendString(PyObject * list, const char * str)
 
 int P4Result::AddOutput( const char *msg )
 {
-    return AppendString(output, msg);
+    PyObject *s = specMgr->CreatePyString(msg);
+    if (!s) {
+	return -1;
+    }
+    return AddOutput(s);
 }
 
 int P4Result::AddTrack( PyObject * t )
@@ -152,6 +213,15 @@ void P4Result::ClearTrack()
 
 int P4Result::AddOutput( PyObject * out )
 {
+    if (stream) {
+	stream->Push(out);
+	return 0;
+    }
+
+    // Specs are dict subclasses and stay separate
+    if (columnar && PyDict_CheckExact(out))
+	return AddRow(out);
+
     if (PyList_Append(output, out) == -1) {
     	return -1;
     }
@@ -160,6 +230,133 @@ int P4Result::AddOutput( PyObject * out )
     return 0;
 }
 
+//
+// Appends a record to the columns. A tag seen for the first time gets a
+// column padded with None for the earlier records; tags missing from
+// this record get None.
+//
+
+int P4Result::AddRow( PyObject * row )
+{
+    PyObject * key;
+    PyObject * value;
+    Py_ssize_t pos = 0;
+
+    // Only commands with tagged output need the columns
+    if (!columns && !(columns = PyDict_New())) {
+	Py_DECREF(row);
+	return -1;
+    }
+
+    while (PyDict_Next(row, &pos, &key, &value)) {
+	PyObject * list = PyDict_GetItem(columns, key);
+	if (!list) {
+	    list = PyList_New(rows);
+	    if (!list) {
+		Py_DECREF(row);
+		return -1;
+	    }
+	    for (Py_ssize_t i = 0; i < rows; i++) {
+		Py_INCREF(Py_None);
+		PyList_SET_ITEM(list, i, Py_None);
+	    }
+	    int r = PyDict_SetItem(columns, key, list);
+	    Py_DECREF(list);
+	    if (r == -1) {
+		Py_DECREF(row);
+		return -1;
+	    }
+	}
+	if (PyList_Append(list, value) == -1) {
+	    Py_DECREF(row);
+	    return -1;
+	}
+    }
+    Py_DECREF(row);
+
+    rows++;
+
+    pos = 0;
+    PyObject * list;
+    while (PyDict_Next(columns, &pos, &key, &list)) {
+	if (PyList_GET_SIZE(list) < rows && PyList_Append(list, Py_None) == -1)
+	    return -1;
+    }
+
+    return 0;
+}
+
+//
+// Returns the column as an array.array if every entry is an int or a
+// decimal integer that survives the round trip through int, otherwise NULL.
+//
+
+PyObject * P4Result::TypedColumn( PyObject * list )
+{
+    Py_ssize_t len = PyList_GET_SIZE(list);
+    if (len == 0)
+	return NULL;
+
+    vector<ColumnInt> values(len);
+
+    for (Py_ssize_t i = 0; i < len; i++) {
+	PyObject * item = PyList_GET_ITEM(list, i);
+
+	// already converted in typed mode, see SpecMgr::SetTyped()
+	if (PyLong_Check(item)) {
+	    int overflow;
+	    long long v = PyLong_AsLongLongAndOverflow(item, &overflow);
+	    if (overflow || (v == -1 && PyErr_Occurred()) || (ColumnInt) v != v) {
+		PyErr_Clear();
+		return NULL;
+	    }
+	    values[i] = (ColumnInt) v;
+	    continue;
+	}
+
+	if (!IsString(item))
+	    return NULL;
+
+	const char * s = GetPythonString(item);
+	if (!s) {
+	    PyErr_Clear();
+	    return NULL;
+	}
+
+	const char * d = (*s == '-') ? s + 1 : s;
+	if (!isdigit((unsigned char) *d) || (*d == '0' && d[1]))
+	    return NULL;
+
+	char * end;
+	errno = 0;
+	long long v = strtoll(s, &end, 10);
+	if (errno || *end || (ColumnInt) v != v)
+	    return NULL;
+
+	values[i] = (ColumnInt) v;
+    }
+
+    PyObject * module = PyImport_ImportModule("array");
+    if (!module) {
+	PyErr_Clear();
+	return NULL;
+    }
+
+    PyObject * data = PyBytes_FromStringAndSize((const char *) &values[0],
+					       len * sizeof(ColumnInt));
+    PyObject * typed = NULL;
+    if (data)
+	typed = PyObject_CallMethod(module, (char *) "array", (char *) "sO",
+				    COLUMN_TYPECODE, data);
+    Py_XDECREF(data);
+    Py_DECREF(module);
+
+    if (!typed)
+	PyErr_Clear();
+
+    return typed;
+}
+
 int
 P4Result::AddError( Error *e )
 {
@@ -32,6 +32,8 @@
 #ifndef P4RESULT_H
 #define P4RESULT_H
 
+class PythonResultStream;
+
 class P4Result
 {
 public:
@@ -47,8 +49,21 @@ public:
     void	ClearTrack();
     void	SetApiLevel( int level ) { apiLevel = level; }
 
+    // Output is passed on to the stream instead of being collected
+    void	SetStream( PythonResultStream * s ) { stream = s; }
+
+    // Tagged records are collected into one list per tag, returned as a
+    // dict at the start of the output. 2 also turns integer columns into
+    // array.array objects.
+    void	SetColumnar( int c )	{ columnar = c; }
+    int		GetColumnar()		{ return columnar; }
+
     // Getting
     PyObject *	GetOutput();
+
+    // Hands over the output collected so far and starts a new list,
+    // errors and warnings keep accumulating
+    PyObject *	TakeOutput();
     PyObject *	GetErrors()     { Py_INCREF(errors); return errors;     }
     PyObject *	GetWarnings()   { Py_INCREF(warnings); return warnings; }
     PyObject *	GetMessages()   { Py_INCREF(messages); return messages; }
@@ -73,14 +88,20 @@ private:
     int         Length( PyObject * ary );
     void        Fmt( const char *label, PyObject * list, StrBuf &buf );
     int		AppendString(PyObject * list, const char * str);
+    int		AddRow( PyObject * row );
+    PyObject *	TypedColumn( PyObject * list );
 
     PyObject *	output;
     PyObject *	warnings;
     PyObject *	errors;
     PyObject *	messages;
     PyObject *	track;
+    PyObject *	columns;
+    Py_ssize_t	rows;
     SpecMgr *	specMgr;
+    PythonResultStream * stream;
     int         apiLevel;
+    int		columnar;
     bool	fatal;
 };
 
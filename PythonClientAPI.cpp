@@ -48,10 +48,12 @@ $Id: //depot/r13.1/p4-python/PythonClientAPI.cpp#1 $
 #include "PythonClientAPI.h"
 #include "P4PythonDebug.h"
 #include "PythonThreadGuard.h"
+#include "PythonResultStream.h"
 #include "PythonMergeData.h"
 #include "P4MapMaker.h"
 #include "PythonMessage.h"
 #include "PythonTypes.h"
+#include "P4RecordFilter.h"
 
 #include <iostream>
 
@@ -67,6 +69,11 @@ PythonClientAPI::PythonClientAPI() : ui(&specMgr)
     debug = 0;
     server2 = 0;
     depth = 0;
+    disconnecting = 0;
+    iterStream = 0;
+    asyncCommand = 0;
+    asyncCallback = 0;
+    asyncOwner = 0;
     exceptionLevel = 2;
     maxResults = 0;
     maxScanRows = 0;
@@ -124,6 +131,7 @@ PythonClientAPI::~PythonClientAPI()
 	client.Final( &e );
 	// Ignore errors
     }
+    delete asyncCommand;
     delete enviro;
 }
 
@@ -133,6 +141,10 @@ PythonClientAPI::intattribute_t PythonClientAPI::intattributes[] = {
 	{ "maxresults",		&PythonClientAPI::SetMaxResults,	&PythonClientAPI::GetMaxResults },
 	{ "maxscanrows",	&PythonClientAPI::SetMaxScanRows,	&PythonClientAPI::GetMaxScanRows },
 	{ "maxlocktime",	&PythonClientAPI::SetMaxLockTime,	&PythonClientAPI::GetMaxLockTime },
+	{ "batch_size",		&PythonClientAPI::SetBatchSize,		&PythonClientAPI::GetBatchSize },
+	{ "handler_batch_size",	&PythonClientAPI::SetHandlerBatchSize,	&PythonClientAPI::GetHandlerBatchSize },
+	{ "lazy_records",	&PythonClientAPI::SetLazyRecords,	&PythonClientAPI::GetLazyRecords },
+	{ "columnar",		&PythonClientAPI::SetColumnar,		&PythonClientAPI::GetColumnar },
 	{ "exception_level",	&PythonClientAPI::SetExceptionLevel,	&PythonClientAPI::GetExceptionLevel },
 	{ "debug",		&PythonClientAPI::SetDebug,		&PythonClientAPI::GetDebug },
 	{ "track",		&PythonClientAPI::SetTrack,		&PythonClientAPI::GetTrack },
@@ -150,6 +162,8 @@ PythonClientAPI::strattribute_t PythonClientAPI::strattributes[] = {
 	{ "port",		&PythonClientAPI::SetPort,		&PythonClientAPI::GetPort },
 	{ "prog",		&PythonClientAPI::SetProg,		&PythonClientAPI::GetProg },
 	{ "ticket_file",	&PythonClientAPI::SetTicketFile,	&PythonClientAPI::GetTicketFile },
+	{ "spec_cache_file",	&PythonClientAPI::SetSpecCacheFile,	&PythonClientAPI::GetSpecCacheFile },
+	{ "filter",		&PythonClientAPI::SetFilter,		&PythonClientAPI::GetFilter },
 	{ "password",		&PythonClientAPI::SetPassword,		&PythonClientAPI::GetPassword },
 	{ "user",		&PythonClientAPI::SetUser,		&PythonClientAPI::GetUser },
 	{ "version",		&PythonClientAPI::SetVersion,		&PythonClientAPI::GetVersion },	
@@ -166,6 +180,9 @@ PythonClientAPI::objattribute_t PythonClientAPI::objattributes[] = {
         { "resolver",           &PythonClientAPI::SetResolver,          &PythonClientAPI::GetResolver },
         { "handler",            &PythonClientAPI::SetHandler,           &PythonClientAPI::GetHandler },
         { "progress",           &PythonClientAPI::SetProgress,          &PythonClientAPI::GetProgress },
+	{ "intern",		&PythonClientAPI::SetIntern,		&PythonClientAPI::GetIntern },
+	{ "fields",		&PythonClientAPI::SetFields,		&PythonClientAPI::GetFields },
+	{ "typed",		&PythonClientAPI::SetTyped,		&PythonClientAPI::GetTyped },
         { "errors",		NULL,					&PythonClientAPI::GetErrors },
 	{ "warnings",		NULL,					&PythonClientAPI::GetWarnings },
         { "messages",		NULL,					&PythonClientAPI::GetMessages },
@@ -631,7 +648,12 @@ PyObject * PythonClientAPI::ConnectOrReconnect()
     Error e;
 
     ResetFlags();
-    client.Init( &e );
+    disconnecting = 0;
+    {
+	// Connecting can take a while, let other threads carry on
+	ReleasePythonLock guard;
+	client.Init( &e );
+    }
     if ( e.Test() && exceptionLevel ) {
 	Except( "P4.connect()", &e );
 	return NULL;
@@ -649,6 +671,10 @@ PyObject * PythonClientAPI::ConnectOrReconnect()
     }
 
     SetConnected();
+
+    // Bring back the specdefs we already know for this server
+    specMgr.SetServer( GetPort() );
+
     Py_RETURN_NONE;
 }
 
@@ -668,6 +694,21 @@ PyObject * PythonClientAPI::Disconnect()
     if ( P4PYDBG_COMMANDS )
 	cerr << "[P4] Disconnect" << endl;
 
+    // Commands cancelled from here must not reconnect behind our back
+    disconnecting = 1;
+
+    // Stop any command that is still streaming its results
+    if ( iterStream )
+	IterClose( iterStream );
+
+    // Wait for a command running in the background to give up
+    if ( asyncCommand && ! asyncCommand->IsFinished() )
+    {
+	asyncCommand->Abandon();
+	ui.Cancel();
+	asyncCommand->Join();
+    }
+
     if ( ! IsConnected() )
     {
 	(void) PyErr_WarnEx( PyExc_UserWarning, 
@@ -679,7 +720,8 @@ PyObject * PythonClientAPI::Disconnect()
     client.Final( &e );
     ResetFlags();
     
-    // Clear the specdef cache.
+    // Clear the specdef cache. The server's specdefs are remembered
+    // and come back when we connect again.
     specMgr.Reset();
 
     // Clear out any results from the last command
@@ -726,35 +768,313 @@ PyObject * PythonClientAPI::Run( const char *cmd, int argc, char * const *argv )
     RunCmd( cmd, &ui, argc, argv );
     depth--;
 
-    PyObject *handler = ui.GetHandler();
-    Py_DECREF(handler);
-    if( handler != Py_None ) {
-	if( client.Dropped() && ! ui.IsAlive() ) {
-	    Disconnect();
-	    ConnectOrReconnect();
-	}
+    if ( CheckResults( cmdString.Text() ) )
+	return NULL;
 
-	if( PyErr_Occurred() )
-	    return NULL;
+    return ui.GetResults().GetOutput();
+}
+
+//
+// Raises an exception for the errors and warnings of the last command,
+// depending on the exception level. Returns -1 if an exception was raised.
+//
+
+int PythonClientAPI::CheckResults( const char *cmdString )
+{
+    // A cancelled command leaves a dropped connection behind. If it was
+    // cancelled by Disconnect(), that is closing the connection for us.
+    if( client.Dropped() && ! ui.IsAlive() && ! disconnecting ) {
+	Disconnect();
+	ConnectOrReconnect();
     }
 
+    if( PyErr_Occurred() )
+	return -1;
+
     P4Result &results = ui.GetResults();
 
     if ( results.ErrorCount() && exceptionLevel ) {
-	Except( "P4#run", "Errors during command execution", cmdString.Text() );
+	Except( "P4#run", "Errors during command execution", cmdString );
 
-	if( results.FatalError() )
+	if( results.FatalError() && ! disconnecting )
 	    Disconnect();
 
-	return NULL;
+	return -1;
     }
 
     if ( results.WarningCount() && exceptionLevel > 1 ) {
-	Except( "P4#run", "Warnings during command execution",cmdString.Text());
+	Except( "P4#run", "Warnings during command execution", cmdString );
+	return -1;
+    }
+
+    return 0;
+}
+
+//
+// Streaming execution. The command runs on a thread of its own and hands
+// its results to the consumer through a bounded PythonResultStream, so
+// only a handful of results exist at any time and the first one is
+// available as soon as the server has sent it.
+//
+
+static void RunIterThread( void * api )
+{
+    EnsurePythonLock guard;
+
+    ((PythonClientAPI *) api)->RunIterCommand();
+}
+
+PyObject * PythonClientAPI::RunIter( const char *cmd, int argc, 
+				     char * const *argv,
+				     PythonResultStream * stream )
+{
+    stream->SetCommand( cmd, argc, argv );
+
+    if ( P4PYDBG_COMMANDS )
+	cerr << "[P4] Streaming " << stream->GetCmdString() << endl;
+
+    if ( depth )
+    {
+    	(void) PyErr_WarnEx( PyExc_UserWarning, 
+		"P4.run_iter() - Can't execute nested Perforce commands.", 1 );
+	Py_RETURN_FALSE;
+    }
+
+    // Clear out any results from the previous command
+    ui.Reset();
+
+    // Tell the UI which command we're running.
+    ui.SetCommand( cmd );
+
+    if ( ! IsConnected() && exceptionLevel ) {
+	Except( "P4.run_iter()", "not connected." );
+	return NULL;
+    }
+    
+    if ( ! IsConnected()  )
+	Py_RETURN_FALSE;
+
+    // Results go to the stream instead of the result list, and the
+    // consumer can stop the command through the KeepAlive interface
+
+    depth++;
+    iterStream = stream;
+    ui.GetResults().SetStream( stream );
+    client.SetBreak( &ui );
+    PrepareCmd( &ui );
+
+    if ( (long) PyThread_start_new_thread( RunIterThread, this ) == -1 )
+    {
+	EndIter();
+	PyErr_SetString( P4Error, 
+		"[P4.run_iter()] Could not start the command thread." );
 	return NULL;
     }
 
-    return results.GetOutput();
+    Py_RETURN_TRUE;
+}
+
+void PythonClientAPI::RunIterCommand()
+{
+    PythonResultStream * stream = iterStream;
+
+    ExecCmd( stream->GetCommand(), &ui, stream->GetArgc(), stream->GetArgv() );
+
+    // Exceptions raised by an output handler are passed on to the consumer
+    stream->SaveError();
+    stream->Finish();
+}
+
+PyObject * PythonClientAPI::IterNext( PythonResultStream * stream )
+{
+    PyObject * result = stream->Pop();
+    if ( result || stream != iterStream )
+	return result;
+
+    // The command has finished and all results have been consumed
+
+    EndIter();
+
+    if ( ! stream->RestoreError() )
+	CheckResults( stream->GetCmdString() );
+
+    return NULL;
+}
+
+void PythonClientAPI::IterClose( PythonResultStream * stream )
+{
+    if ( stream != iterStream )
+	return;
+
+    if ( ! stream->IsFinished() )
+    {
+	if ( P4PYDBG_COMMANDS )
+	    cerr << "[P4] Cancelling " << stream->GetCmdString() << endl;
+
+	// Ask the server to stop and wait for the command thread to finish
+	stream->Cancel();
+	ui.Cancel();
+	stream->Join();
+    }
+
+    EndIter();
+
+    if ( IsConnected() && client.Dropped() && ! disconnecting ) {
+	Disconnect();
+	ConnectOrReconnect();
+    }
+}
+
+void PythonClientAPI::EndIter()
+{
+    ui.GetResults().SetStream( NULL );
+    iterStream = 0;
+    depth--;
+
+    ResetBreak();
+}
+
+//
+// Background execution. Like RunIter(), but the results are collected as
+// they are by Run() and handed to a callback when the command is done.
+//
+
+static void RunAsyncThread( void * api )
+{
+    EnsurePythonLock guard;
+
+    // Dropping the owner may well delete the PythonClientAPI itself
+    PyObject * owner = ((PythonClientAPI *) api)->RunAsyncCommand();
+    Py_DECREF( owner );
+}
+
+PyObject * PythonClientAPI::RunAsync( const char *cmd, int argc, 
+				      char * const *argv,
+				      PyObject * callback, PyObject * owner )
+{
+    if ( P4PYDBG_COMMANDS )
+	cerr << "[P4] Starting \"p4 " << cmd << "\" in the background" << endl;
+
+    if ( depth )
+    {
+    	(void) PyErr_WarnEx( PyExc_UserWarning, 
+		"P4.run_async() - Can't execute nested Perforce commands.", 1 );
+	Py_RETURN_FALSE;
+    }
+
+    // Clear out any results from the previous command
+    ui.Reset();
+
+    // Tell the UI which command we're running.
+    ui.SetCommand( cmd );
+
+    if ( ! IsConnected() && exceptionLevel ) {
+	Except( "P4.run_async()", "not connected." );
+	return NULL;
+    }
+    
+    if ( ! IsConnected()  )
+	Py_RETURN_FALSE;
+
+    // The previous background command, if any, is long finished
+    delete asyncCommand;
+    asyncCommand = new PythonAsyncCommand;
+    asyncCommand->SetCommand( cmd, argc, argv );
+
+    Py_INCREF( callback );
+    asyncCallback = callback;
+    Py_INCREF( owner );
+    asyncOwner = owner;
+
+    depth++;
+    client.SetBreak( &ui );
+    PrepareCmd( &ui );
+
+    if ( (long) PyThread_start_new_thread( RunAsyncThread, this ) == -1 )
+    {
+	depth--;
+	ResetBreak();
+	asyncCommand->Finish();
+	Py_CLEAR( asyncCallback );
+	Py_CLEAR( asyncOwner );
+	PyErr_SetString( P4Error, 
+		"[P4.run_async()] Could not start the command thread." );
+	return NULL;
+    }
+
+    Py_RETURN_TRUE;
+}
+
+PyObject * PythonClientAPI::RunAsyncCommand()
+{
+    PythonAsyncCommand * command = asyncCommand;
+
+    ExecCmd( command->GetCommand(), &ui, command->GetArgc(), 
+	     command->GetArgv() );
+    ResetBreak();
+
+    // Whatever arrived before Disconnect() stopped the command is not
+    // what run() would have returned
+    PyObject * results = NULL;
+    if ( command->IsAbandoned() ) {
+	PyErr_Clear();
+	Except( "P4.run_async()",
+		"disconnected before the command finished." );
+    }
+    else if ( ! PyErr_Occurred() && ! CheckResults( command->GetCmdString() ) )
+	results = ui.GetResults().GetOutput();
+
+    PyObject *type = NULL, *value = NULL, *traceback = NULL;
+    if ( ! results ) {
+	PyErr_Fetch( &type, &value, &traceback );
+	PyErr_NormalizeException( &type, &value, &traceback );
+    }
+
+    // From here on Disconnect() no longer waits for us
+    command->Finish();
+
+    PyObject * callback = asyncCallback;
+    PyObject * owner = asyncOwner;
+    asyncCallback = 0;
+    asyncOwner = 0;
+    depth--;
+
+    PyObject * r = PyObject_CallFunctionObjArgs( callback, 
+			results ? results : Py_None,
+			value ? value : Py_None, NULL );
+    if ( r )
+	Py_DECREF( r );
+    else
+	PyErr_WriteUnraisable( callback );
+
+    Py_XDECREF( results );
+    Py_XDECREF( type );
+    Py_XDECREF( value );
+    Py_XDECREF( traceback );
+    Py_DECREF( callback );
+
+    return owner;
+}
+
+PyObject * PythonClientAPI::Cancel()
+{
+    if ( iterStream || ( asyncCommand && ! asyncCommand->IsFinished() ) )
+    {
+	if ( P4PYDBG_COMMANDS )
+	    cerr << "[P4] Cancelling background command" << endl;
+
+	ui.Cancel();
+    }
+
+    Py_RETURN_NONE;
+}
+
+void PythonClientAPI::ResetBreak()
+{
+    PyObject *handler = ui.GetHandler();
+    Py_DECREF(handler);
+    if( handler == Py_None )
+	client.SetBreak( NULL );
 }
 
 
@@ -933,6 +1253,223 @@ PyObject * PythonClientAPI::FormatSpec( const char *type, PyObject * dict )
     Py_RETURN_NONE;
 }
 
+//
+// Feeds file arguments to a command a chunk at a time. The arguments are
+// pulled from the iterator only when the next chunk is due, so a long list
+// of files never has to exist in memory as a whole. Results, errors and
+// warnings of all chunks are collected as if it had been one command.
+//
+
+PyObject * PythonClientAPI::RunChunked( const char *cmd, int argc,
+					char * const *argv,
+					PyObject * files, int chunk )
+{
+    StrBuf	cmdString;
+    cmdString << "\"p4 " << cmd;
+    for( int i = 0; i < argc; i++ )
+        cmdString << " " << argv[ i ];
+    cmdString << " ...\"";
+
+    if ( P4PYDBG_COMMANDS )
+	cerr << "[P4] Executing " << cmdString.Text() 
+	     << " in chunks of " << chunk << endl;
+
+    if ( depth )
+    {
+    	(void) PyErr_WarnEx( PyExc_UserWarning, 
+		"P4.run() - Can't execute nested Perforce commands.", 1 );
+	Py_RETURN_FALSE;
+    }
+
+    if ( chunk < 1 )
+    {
+	PyErr_SetString( PyExc_ValueError, "chunk must be at least 1" );
+	return NULL;
+    }
+
+    // Clear out any results from the previous command
+    ui.Reset();
+
+    // Tell the UI which command we're running.
+    ui.SetCommand( cmd );
+
+    if ( ! IsConnected() && exceptionLevel ) {
+	Except( "P4.run()", "not connected." );
+	return NULL;
+    }
+    
+    if ( ! IsConnected()  )
+	Py_RETURN_FALSE;
+
+    vector<const char *>	args( argv, argv + argc );
+    vector<PyObject *>		held;
+
+    depth++;
+    while ( ui.IsAlive() && ! PyErr_Occurred() )
+    {
+	PyObject * item;
+	while ( (int) held.size() < chunk && ( item = PyIter_Next( files ) ) )
+	{
+	    if ( ! PyBytes_Check( item ) )
+	    {
+		PyObject * s = PyObject_Str( item );
+		Py_DECREF( item );
+		if ( ! s )
+		    break;
+		item = s;
+	    }
+	    held.push_back( item );
+	    args.push_back( GetPythonString( item ) );
+	}
+
+	if ( held.empty() || PyErr_Occurred() )
+	    break;
+
+	RunCmd( cmd, &ui, (int) args.size(), (char * const *) &args[0] );
+
+	for ( size_t i = 0; i < held.size(); i++ )
+	    Py_DECREF( held[ i ] );
+	held.clear();
+	args.resize( argc );
+    }
+    depth--;
+
+    for ( size_t i = 0; i < held.size(); i++ )
+	Py_DECREF( held[ i ] );
+
+    if ( CheckResults( cmdString.Text() ) )
+	return NULL;
+
+    return ui.GetResults().GetOutput();
+}
+
+//
+// Runs a batch of commands through ClientApi::RunTag() so that the server
+// works on the next command while we are still receiving the results of
+// the previous one. WaitTag() after every window keeps the number of
+// commands in flight bounded.
+//
+
+PyObject * PythonClientAPI::RunPipelined( int count, const char * const * cmds,
+					  const int * argcs,
+					  char * const * const * argvs,
+					  int window )
+{
+    StrBuf	cmdString;
+    cmdString << "\"p4 " << ( count ? cmds[ 0 ] : "" ) << " ...\" (" 
+	      << count << " pipelined commands)";
+
+    if ( P4PYDBG_COMMANDS )
+	cerr << "[P4] Executing " << cmdString.Text() << endl;
+
+    if ( depth )
+    {
+    	(void) PyErr_WarnEx( PyExc_UserWarning, 
+		"P4.run_pipelined() - Can't execute nested Perforce commands.", 1 );
+	Py_RETURN_FALSE;
+    }
+
+    // Clear out any results from the previous command
+    ui.Reset();
+
+    if ( ! IsConnected() && exceptionLevel ) {
+	Except( "P4.run_pipelined()", "not connected." );
+	return NULL;
+    }
+    
+    if ( ! IsConnected()  )
+	Py_RETURN_FALSE;
+
+    if ( window < 1 )
+	window = 1;
+
+    PyObject * outputs = PyList_New( 0 );
+    if ( !outputs )
+	return NULL;
+
+    ui.SetPipeline( outputs, count, cmds );
+
+    depth++;
+    for ( int i = 0; i < count && ui.IsAlive(); i += window )
+    {
+	int end = i + window < count ? i + window : count;
+
+	for ( int j = i; j < end; j++ )
+	{
+	    PrepareCmd( &ui );
+
+	    vector<char *> projected;
+	    StrBuf fieldList;
+	    int argc = argcs[ j ];
+	    char * const * argv = ProjectArgs( cmds[ j ], argc, argvs[ j ], 
+					       projected, fieldList );
+
+	    ReleasePythonLock guard;
+	    client.SetArgv( argc, argv );
+	    client.RunTag( cmds[ j ], &ui );
+	}
+
+	ReleasePythonLock guard;
+	client.WaitTag();
+    }
+    depth--;
+
+    ui.SetPipeline( NULL, 0, NULL );
+    LearnServer();
+
+    if ( CheckResults( cmdString.Text() ) )
+    {
+	Py_DECREF( outputs );
+	return NULL;
+    }
+
+    return outputs;
+}
+
+//
+// Bulk versions of ParseSpec() and FormatSpec(), see SpecMgr::StringsToSpecs()
+//
+
+PyObject * PythonClientAPI::ParseSpecs( const char * type, PyObject * forms )
+{
+    Error e;
+    PyObject * v = specMgr.StringsToSpecs( type, forms, &e );
+
+    if ( e.Test() ) 
+    {
+	Py_XDECREF( v );
+	if( exceptionLevel ) {
+	    Except( "P4.parse_specs()", &e );
+	    return NULL;
+	}
+	else {
+	    Py_RETURN_FALSE;
+	}
+    }
+
+    return v;
+}
+
+PyObject * PythonClientAPI::FormatSpecs( const char * type, PyObject * specs )
+{
+    Error e;
+    PyObject * v = specMgr.SpecsToStrings( type, specs, &e );
+
+    if ( e.Test() ) 
+    {
+	Py_XDECREF( v );
+	if( exceptionLevel ) {
+	    Except( "P4.format_specs()", &e );
+	    return NULL;
+	}
+	else {
+	    Py_RETURN_FALSE;
+	}
+    }
+
+    return v;
+}
+
 //
 // Returns a dict whose keys contain the names of the fields in a spec of the
 // specified type. Not yet exposed to Python clients, but may be in future.
@@ -1108,6 +1645,18 @@ void PythonClientAPI::Except( const char *func, const char *msg, const char *cmd
 //
 
 void PythonClientAPI::RunCmd(const char *cmd, ClientUser *ui, int argc, char * const *argv)
+{
+    PrepareCmd( ui );
+    ExecCmd( cmd, ui, argc, argv );
+}
+
+//
+// Passes the settings of this object on to the ClientApi. Kept apart from
+// ExecCmd() so that commands running on a thread of their own pick up the
+// settings in place when they were started.
+//
+
+void PythonClientAPI::PrepareCmd(ClientUser *ui)
 {
 // #if P4APIVER_ID >= 513026
     // ClientApi::SetProg() was introduced in 2004.2
@@ -1134,6 +1683,13 @@ void PythonClientAPI::RunCmd(const char *cmd, ClientUser *ui, int argc, char * c
     // if progress is set, set the progress var
     if( ((PythonClientUser*)ui)->GetProgress() != Py_None )
 	client.SetVar( P4Tag::v_progress, 1);
+}
+
+void PythonClientAPI::ExecCmd(const char *cmd, ClientUser *ui, int argc, char * const *argv)
+{
+    vector<char *> projected;
+    StrBuf fieldList;
+    argv = ProjectArgs( cmd, argc, argv, projected, fieldList );
 
     {
         ReleasePythonLock guard;
@@ -1141,7 +1697,48 @@ void PythonClientAPI::RunCmd(const char *cmd, ClientUser *ui, int argc, char * c
         client.SetArgv( argc, argv );
         client.Run( cmd, ui );
     }
-    
+
+    // Convert whatever is still staged, see PythonClientUser::FlushOutput()
+    ((PythonClientUser*)ui)->FlushOutput();
+
+    LearnServer();
+}
+
+//
+// With a field projection in place, fstat only needs to send the projected
+// fields, so pass them on as "fstat -T" unless the caller has already
+// chosen the fields. The record filter runs on what the server sends, so
+// the fields it looks at are asked for as well; the projection drops them
+// again. Other commands are filtered on our side only.
+//
+
+char * const * PythonClientAPI::ProjectArgs( const char *cmd, int &argc,
+					     char * const *argv,
+					     vector<char *> &args,
+					     StrBuf &list )
+{
+    const StrPtr * fields = specMgr.GetFieldList();
+    if( !fields || strcmp( cmd, "fstat" ) )
+	return argv;
+
+    for( int i = 0; i < argc; i++ )
+	if( !strcmp( argv[ i ], "-T" ) )
+	    return argv;
+
+    list = *fields;
+    if( ui.GetRecordFilter() )
+	ui.GetRecordFilter()->AddFields( list );
+
+    args.push_back( (char *) "-T" );
+    args.push_back( list.Text() );
+    args.insert( args.end(), argv, argv + argc );
+    argc = (int) args.size();
+
+    return &args[ 0 ];
+}
+
+void PythonClientAPI::LearnServer()
+{
     // Have to request server2 protocol *after* a command has been run. I
     // don't know why, but that's the way it is.
 
@@ -1151,6 +1748,8 @@ void PythonClientAPI::RunCmd(const char *cmd, ClientUser *ui, int argc, char * c
 	if ( pv )
 	    server2 = pv->Atoi();
 
+	specMgr.SetServerLevel( server2 );
+
 	pv = client.GetProtocol( P4Tag::v_nocase );
 	if ( pv ) 
 	    SetCaseFold();
@@ -1158,7 +1757,63 @@ void PythonClientAPI::RunCmd(const char *cmd, ClientUser *ui, int argc, char * c
 	pv = client.GetProtocol( P4Tag::v_unicode );
 	if ( pv && pv->Atoi() )
 	    SetUnicode();
+
+	// One round trip per connection, and only when there are specdefs
+	// to check. The cached ones stay unused if it fails.
+	if ( specMgr.NeedServerId() )
+	{
+	    StrBuf id;
+	    if ( ! client.Dropped() )
+		GetServerId( id );
+	    specMgr.SetServerId( id.Text() );
+	}
     }
     SetCmdRun();
+}
+
+//
+// Collects the identity of the server from "p4 info", see GetServerId()
+//
+
+class ServerIdUser : public ClientUser
+{
+public:
+    void	OutputStat( StrDict *dict )
+    {
+	StrPtr * v = dict->GetVar( "ServerID" );
+	if ( v )
+	{
+	    id = *v;
+	    return;
+	}
+
+	// Servers without an ID are told apart by what they say about
+	// themselves
+	if ( ( v = dict->GetVar( "serverVersion" ) ) )
+	    id << *v;
+	if ( ( v = dict->GetVar( "serverRoot" ) ) )
+	    id << "@" << *v;
+    }
+
+    void	Message( Error *e )		{}
+    void	HandleError( Error *e )		{}
+    void	OutputError( const char *e )	{}
+
+    StrBuf	id;
+};
+
+void PythonClientAPI::GetServerId( StrBuf &id )
+{
+    ServerIdUser	idUser;
+
+    client.SetProg( &prog );
+    client.SetVar( "tag" );
+    {
+	ReleasePythonLock guard;
+
+	client.SetArgv( 0, 0 );
+	client.Run( "info", &idUser );
+    }
 
+    id = idUser.id;
 }
@@ -39,11 +39,16 @@
 #define PYTHON_CLIENT_API_H
 
 class Enviro;
+class PythonResultStream;
+class PythonAsyncCommand;
 class PythonClientAPI
 {
 public:
     PythonClientAPI();
     ~PythonClientAPI();
+
+    // The P4Adapter wrapping us, borrowed. Lazy records keep it alive.
+    void SetOwner( PyObject * o )	{ ui.SetOwner( o ); }
  	
 public:
     typedef int (PythonClientAPI::*intsetter)(int);
@@ -96,6 +101,10 @@ public:
     int SetMaxResults( int v )		{ maxResults = v; return 0; }
     int SetMaxScanRows( int v )		{ maxScanRows = v; return 0; }
     int SetMaxLockTime( int v )		{ maxLockTime = v; return 0; }
+    int SetBatchSize( int v )		{ ui.SetBatchSize( v ); return 0; }
+    int SetHandlerBatchSize( int v )	{ ui.SetHandlerBatchSize( v ); return 0; }
+    int SetLazyRecords( int v )		{ ui.SetLazyRecords( v ); return 0; }
+    int SetColumnar( int v )		{ ui.SetColumnar( v ); return 0; }
     //
     // Debugging support. Debug levels are:
     //
@@ -117,6 +126,8 @@ public:
     int SetPort( const char *p );
     int SetProg( const char *p )	{ prog = p; return 0; }
     int SetTicketFile( const char *p );
+    int SetSpecCacheFile( const char *f ) { specMgr.SetCacheFile( f ); return 0; }
+    int SetFilter( const char *f )	{ return ui.SetFilter( f ); }
     int SetEncoding( const char *e );
     int SetUser( const char *u )	{ client.SetUser( u ); return 0; }
     int SetVersion( const char *v )	{ version = v; return 0; }
@@ -133,6 +144,8 @@ public:
     const char * GetPort()		{ return client.GetPort().Text(); }
     const char * GetProg()		{ return prog.Text(); }
     const char * GetTicketFile()	{ return ticketFile.Text(); }
+    const char * GetSpecCacheFile()	{ return specMgr.GetCacheFile(); }
+    const char * GetFilter()		{ return ui.GetFilter(); }
     const char * GetUser()		{ return client.GetUser().Text(); }
     const char * GetVersion()		{ return version.Text(); }
     const char * GetPatchlevel()	{ return ID_PATCH; }
@@ -140,6 +153,10 @@ public:
     int GetMaxResults()			{ return maxResults; }
     int GetMaxScanRows()		{ return maxScanRows; }
     int GetMaxLockTime()		{ return maxLockTime; }
+    int GetBatchSize()			{ return ui.GetBatchSize(); }
+    int GetHandlerBatchSize()		{ return ui.GetHandlerBatchSize(); }
+    int GetLazyRecords()		{ return ui.GetLazyRecords(); }
+    int GetColumnar()			{ return ui.GetColumnar(); }
     int GetDebug()			{ return debug; }
     int GetApiLevel()			{ return apiLevel; }
     
@@ -154,6 +171,40 @@ public:
 
     // Executing commands. 
     PyObject * Run( const char *cmd, int argc, char * const *argv );
+
+    // Streaming execution. RunIter() starts the command on its own thread
+    // and returns Py_True, the results are then fetched one at a time with
+    // IterNext() until it returns NULL. IterClose() stops the command if it
+    // is still running.
+    PyObject * RunIter( const char *cmd, int argc, char * const *argv,
+			PythonResultStream * stream );
+    PyObject * IterNext( PythonResultStream * stream );
+    void IterClose( PythonResultStream * stream );
+    void RunIterCommand();	// runs on the command thread
+
+    // Background execution. RunAsync() starts the command on its own
+    // thread and returns Py_True. Once the command has finished, the
+    // callback is called on that thread as callback(results, exception).
+    // A reference to owner is held until then. A command stopped by
+    // Disconnect() ends with an exception rather than partial results.
+    PyObject * RunAsync( const char *cmd, int argc, char * const *argv,
+			 PyObject * callback, PyObject * owner );
+    PyObject * RunAsyncCommand();	// runs on the command thread
+
+    // Asks the server to abandon a command running in the background
+    PyObject * Cancel();
+
+    // Runs the command once for every chunk file arguments taken from the
+    // iterator files, collecting the results of all runs, like "p4 -x".
+    PyObject * RunChunked( const char *cmd, int argc, char * const *argv,
+			   PyObject * files, int chunk );
+
+    // Pipelined execution. Sends up to window commands before waiting for
+    // their results, which come back in order as one list per command.
+    PyObject * RunPipelined( int count, const char * const * cmds,
+			     const int * argcs, char * const * const * argvs,
+			     int window );
+
     int SetInput( PyObject * input );
     PyObject * GetInput();
     
@@ -168,6 +219,18 @@ public:
     int SetProgress( PyObject * progress );
     PyObject * GetProgress();
 
+    // Typed values, see SpecMgr::SetTyped()
+    int SetTyped( PyObject * typed )	{ return specMgr.SetTyped( typed ); }
+    PyObject * GetTyped()		{ return specMgr.GetTyped(); }
+
+    // Field projection, see SpecMgr::SetFields()
+    int SetFields( PyObject * fields )	{ return specMgr.SetFields( fields ); }
+    PyObject * GetFields()		{ return specMgr.GetFields(); }
+
+    // Value interning, see SpecMgr::SetIntern()
+    int SetIntern( PyObject * fields )	{ return specMgr.SetIntern( fields ); }
+    PyObject * GetIntern()		{ return specMgr.GetIntern(); }
+
     // Result handling
     PyObject * GetErrors()		{ return ui.GetResults().GetErrors(); }
     PyObject * GetWarnings()		{ return ui.GetResults().GetWarnings();}
@@ -187,6 +250,8 @@ public:
     // Spec parsing
     PyObject * ParseSpec( const char * type, const char *form );
     PyObject * FormatSpec( const char *type, PyObject * dict );
+    PyObject * ParseSpecs( const char * type, PyObject * forms );
+    PyObject * FormatSpecs( const char *type, PyObject * specs );
     PyObject * SpecFields( const char * type );
 
     // Protocol
@@ -222,6 +287,15 @@ public:
     
 private:
     void RunCmd(const char *cmd, ClientUser *ui, int argc, char * const *argv);
+    void PrepareCmd(ClientUser *ui);
+    void ExecCmd(const char *cmd, ClientUser *ui, int argc, char * const *argv);
+    void LearnServer();
+    void GetServerId( StrBuf &id );
+    char * const * ProjectArgs(const char *cmd, int &argc, char * const *argv,
+			       std::vector<char *> &args, StrBuf &list);
+    int  CheckResults( const char *cmdString );
+    void EndIter();
+    void ResetBreak();
     PyObject * ConnectOrReconnect();
 
     static intattribute_t * GetInt(const char * forAttr);
@@ -282,7 +356,12 @@ private:
     StrBuf		prog;
     StrBuf		version;
     StrBuf		ticketFile;
+    PythonResultStream *	iterStream;
+    PythonAsyncCommand *	asyncCommand;
+    PyObject *		asyncCallback;
+    PyObject *		asyncOwner;
     int			depth;
+    int			disconnecting;	// Disconnect() is cancelling commands
     int 		apiLevel;
     int			debug;
     int			exceptionLevel;
@@ -56,28 +56,60 @@ $Id: //depot/r13.1/p4-python/PythonClientUser.cpp#1 $
 #include "PythonActionMergeData.h"
 #include "P4MapMaker.h"
 #include "PythonMessage.h"
+#include "PythonRecord.h"
+#include "PythonOutputSink.h"
+#include "P4RecordFilter.h"
 #include "PythonTypes.h"
 #include "PythonClientProgress.h"
 
 using namespace std;
 
+// Output staged while the GIL is released, see FlushOutput()
+
+struct PythonClientUser::StagedOutput
+{
+    int		type;
+    char	level;
+    StrBuf	data;
+    StrBufDict	dict;
+};
+
+enum { STAGED_TEXT, STAGED_INFO, STAGED_BINARY, STAGED_STAT };
+
 PythonClientUser::PythonClientUser( SpecMgr *s )
     : results(s)
 {
     specMgr = s;
     debug = 0;
+    batchSize = 0;
+    handlerBatchSize = 0;
+    lazyRecords = 0;
+    owner = NULL;
+    pipeline = NULL;
+    pipelineCmds = NULL;
+    pipelineCount = 0;
+    pipelineNext = 0;
+    stagedCount = 0;
     track = false;
     alive = 1;
     apiLevel = atoi( P4Tag::l_client );
     
     Py_INCREF(Py_None);
     input = Py_None;
+    inputPos = 0;
     
     Py_INCREF(Py_None);
     resolver = Py_None;
 
     Py_INCREF(Py_None);
     handler = Py_None;
+    for( int i = 0; i < OUTPUT_METHODS; i++ )
+	handlerMethods[ i ] = NULL;
+    pendingBatch = NULL;
+    pendingMethod = 0;
+    sink = NULL;
+    filter = NULL;
+    activeFilter = NULL;
 
     Py_INCREF(Py_None);
     progress = Py_None;
@@ -88,20 +120,51 @@ PythonClientUser::~PythonClientUser()
     Py_DECREF(input);
     Py_DECREF(resolver);
     Py_DECREF(handler);
+    ClearHandlerMethods();
+    Py_XDECREF(pendingBatch);
+    delete filter;
+    for( size_t i = 0; i < retiredFilters.size(); i++ )
+	delete retiredFilters[ i ];
     Py_DECREF(progress);
+
+    for( size_t i = 0; i < staged.size(); i++ )
+	delete staged[ i ];
 }
 
 void PythonClientUser::Reset()
 {
     results.Reset();
+    Py_CLEAR( pendingBatch );
+    specMgr->ResetIntern();
     // input data is untouched
 
+    // No command is running now, so filters replaced during the last one
+    // can go.
+    for( size_t i = 0; i < retiredFilters.size(); i++ )
+	delete retiredFilters[ i ];
+    retiredFilters.clear();
+    activeFilter = filter;
+
+    // Anything left over from a command that was cut short is dropped,
+    // and so is the staging area of a command that was staged in full.
+    stagedCount = 0;
+    size_t keep = batchSize > 0 ? batchSize : 0;
+    while( staged.size() > keep )
+    {
+	delete staged.back();
+	staged.pop_back();
+    }
+
     alive = 1; // yes, we want data from the server
 }
 
 void PythonClientUser::Finished()
 {
+    FlushOutput();
+
     EnsurePythonLock guard;
+
+    FlushBatch();
     
     if ( P4PYDBG_CALLS && input != Py_None )
 	cerr << "[P4] Cleaning up saved input" << endl;
@@ -110,6 +173,31 @@ void PythonClientUser::Finished()
     Py_INCREF(Py_None);
     input = Py_None;
     Py_DECREF(tmp);
+
+    if( pipeline )
+    {
+	PyObject * out = results.TakeOutput();
+	if( out )
+	{
+	    PyList_Append( pipeline, out );
+	    Py_DECREF( out );
+	}
+
+	if( ++pipelineNext < pipelineCount )
+	    cmd = pipelineCmds[ pipelineNext ];
+    }
+}
+
+void PythonClientUser::SetPipeline( PyObject * outputs, int count,
+				    const char * const * cmds )
+{
+    pipeline = outputs;
+    pipelineCmds = cmds;
+    pipelineCount = count;
+    pipelineNext = 0;
+
+    if( count )
+	cmd = cmds[ 0 ];
 }
 
 static const int REPORT = 0;
@@ -119,11 +207,11 @@ static const int CANCEL = 2;
 // returns true if output should be reported
 // false if the output is handled and should be ignored
 
-bool PythonClientUser::CallOutputMethod( const char * method, PyObject * data)
+bool PythonClientUser::CallOutputMethod( int method, PyObject * data)
 {
     long answer = REPORT;
 
-    PyObject * result = PyObject_CallMethod( this->handler , (char*) method, (char*)"O", data );
+    PyObject * result = CallWithOneArg( handlerMethods[ method ], data );
     if( result == NULL ) { // exception thrown
 	alive = 0;
     }
@@ -144,10 +232,22 @@ bool PythonClientUser::CallOutputMethod( const char * method, PyObject * data)
     return ( answer == 0 );
 }
 
-void PythonClientUser::ProcessOutput( const char * method, PyObject * data )
+void PythonClientUser::ProcessOutput( int method, PyObject * data )
 {
-    if( this->handler != Py_None )
+    if( handlerMethods[ OUTPUT_TEXT ] )
     {
+	int batch = method == OUTPUT_STAT ? OUTPUT_STAT_BATCH :
+		    method == OUTPUT_TEXT ? OUTPUT_TEXT_BATCH : 0;
+
+	if( batch && handlerMethods[ batch ] )
+	{
+	    QueueBatch( batch, data );
+	    return;
+	}
+
+	// Keep the order of the output
+	FlushBatch();
+
 	if( CallOutputMethod( method, data ) )
 	    results.AddOutput( data );
 	else
@@ -159,10 +259,69 @@ void PythonClientUser::ProcessOutput( const char * method, PyObject * data )
 	results.AddOutput( data );
 }
 
+//
+// Handlers that define outputStatBatch() or outputTextBatch() get a list of
+// records per call instead of one call per record. The batch holds up to
+// handler_batch_size records, HANDLER_BATCH if that is not set, and is passed
+// on early whenever other output or a message has to go out first. The
+// return value applies to the whole batch.
+//
+
+static const Py_ssize_t HANDLER_BATCH = 1000;
+
+void PythonClientUser::QueueBatch( int method, PyObject * data )
+{
+    if( pendingBatch && pendingMethod != method )
+	FlushBatch();
+
+    if( !pendingBatch )
+    {
+	pendingBatch = PyList_New( 0 );
+	pendingMethod = method;
+	if( !pendingBatch )
+	{
+	    alive = 0;
+	    Py_DECREF( data );
+	    return;
+	}
+    }
+
+    if( PyList_Append( pendingBatch, data ) < 0 )
+	alive = 0;
+    Py_DECREF( data );
+
+    Py_ssize_t limit = handlerBatchSize > 0 ? handlerBatchSize : HANDLER_BATCH;
+    if( PyList_GET_SIZE( pendingBatch ) >= limit )
+	FlushBatch();
+}
+
+void PythonClientUser::FlushBatch()
+{
+    if( !pendingBatch )
+	return;
+
+    PyObject * batch = pendingBatch;
+    pendingBatch = NULL;
+
+    if( alive && CallOutputMethod( pendingMethod, batch ) )
+    {
+	for( Py_ssize_t i = 0; i < PyList_GET_SIZE( batch ); i++ )
+	{
+	    PyObject * item = PyList_GET_ITEM( batch, i );
+	    Py_INCREF( item );
+	    results.AddOutput( item );
+	}
+    }
+
+    Py_DECREF( batch );
+}
+
 void PythonClientUser::ProcessMessage( Error *e )
 {
-    if( this->handler != Py_None )
+    if( handlerMethods[ OUTPUT_TEXT ] )
     {
+	FlushBatch();
+
 	int s = e->GetSeverity();
 
 	if ( s == E_EMPTY || s == E_INFO )
@@ -175,7 +334,7 @@ void PythonClientUser::ProcessMessage( Error *e )
 	    e->Fmt( &m, EF_PLAIN );
 	    PyObject * s = specMgr->CreatePyString( m.Text() );
 
-	    if( s && CallOutputMethod( "outputInfo", s) )
+	    if( s && CallOutputMethod( OUTPUT_INFO, s ) )
 		results.AddOutput( s );
 	}
 	else
@@ -183,7 +342,7 @@ void PythonClientUser::ProcessMessage( Error *e )
 	    P4Message * msg = (P4Message *) PyObject_New(P4Message, &P4MessageType);
 	    msg->msg = new PythonMessage(e, specMgr);
 
-	    if( CallOutputMethod( "outputMessage", (PyObject *) msg ) )
+	    if( CallOutputMethod( OUTPUT_MESSAGE, (PyObject *) msg ) )
 		results.AddError( e );
 	}
     }
@@ -193,6 +352,8 @@ void PythonClientUser::ProcessMessage( Error *e )
 
 void PythonClientUser::Message( Error *e )
 {
+    FlushOutput();
+
     EnsurePythonLock guard;
 
     if( P4PYDBG_CALLS )
@@ -234,6 +395,8 @@ ClientProgress * PythonClientUser::CreateProgress( int type )
 
 void PythonClientUser::HandleError( Error *e )
 {
+    FlushOutput();
+
     EnsurePythonLock guard;
     
     if( P4PYDBG_CALLS )
@@ -249,10 +412,136 @@ void PythonClientUser::HandleError( Error *e )
     ProcessMessage( e );
 }
 
+//
+// Batched output. With a batch size set, the output callbacks below only
+// copy the data into the staging area, which needs no Python objects and
+// therefore no GIL. FlushOutput() then converts the whole batch while it
+// holds the GIL once. Staged output is flushed before any other callback
+// so that the order in which output reaches Python is preserved.
+//
+
+PythonClientUser::StagedOutput * PythonClientUser::Stage( int type )
+{
+    if( stagedCount == (int) staged.size() )
+	staged.push_back( new StagedOutput );
+
+    StagedOutput * s = staged[ stagedCount++ ];
+    s->type = type;
+    s->data.Clear();
+    s->dict.Clear();
+    return s;
+}
+
+void PythonClientUser::CheckBatch()
+{
+    if( batchSize > 0 && stagedCount >= batchSize )
+	FlushOutput();
+}
+
+void PythonClientUser::FlushOutput()
+{
+    if( !stagedCount )
+	return;
+
+    EnsurePythonLock guard;
+
+    if( P4PYDBG_CALLS )
+	cerr << "[P4] FlushOutput() - " << stagedCount << " records" << endl;
+
+    int count = stagedCount;
+    stagedCount = 0;
+
+    // Stop as soon as a handler has raised an exception or cancelled
+    for( int i = 0; i < count && alive; i++ )
+    {
+	StagedOutput * s = staged[ i ];
+
+	switch( s->type )
+	{
+	case STAGED_TEXT:
+	    ProcessText( s->data.Text(), s->data.Length() );
+	    break;
+	case STAGED_INFO:
+	    ProcessInfo( s->level, s->data.Text() );
+	    break;
+	case STAGED_BINARY:
+	    ProcessBinary( s->data.Text(), s->data.Length() );
+	    break;
+	case STAGED_STAT:
+	    ProcessStat( &s->dict );
+	    break;
+	}
+    }
+}
+
 void PythonClientUser::OutputText( const char *data, int length )
 {
+    if( batchSize )
+    {
+	Stage( STAGED_TEXT )->data.Set( data, length );
+	CheckBatch();
+	return;
+    }
+
     EnsurePythonLock guard;
-    
+    ProcessText( data, length );
+}
+
+void PythonClientUser::OutputInfo( char level, const char *data )
+{
+    if( batchSize )
+    {
+	StagedOutput * s = Stage( STAGED_INFO );
+	s->level = level;
+	s->data.Set( data );
+	CheckBatch();
+	return;
+    }
+
+    EnsurePythonLock guard;
+    ProcessInfo( level, data );
+}
+
+void PythonClientUser::OutputBinary( const char *data, int length )
+{
+    if( batchSize )
+    {
+	Stage( STAGED_BINARY )->data.Set( data, length );
+	CheckBatch();
+	return;
+    }
+
+    EnsurePythonLock guard;
+    ProcessBinary( data, length );
+}
+
+void PythonClientUser::OutputStat( StrDict *values )
+{
+    // Forms are never filtered, P4.fetch_*() and friends depend on them
+    if( activeFilter && !values->GetVar( "specdef" ) &&
+	!activeFilter->Match( values ) )
+	return;
+
+    // A native sink takes the record as it is, no GIL needed
+    if( sink )
+    {
+	sink->OutputStat( values, specMgr->GetEncoding() );
+	return;
+    }
+
+    if( batchSize )
+    {
+	Stage( STAGED_STAT )->dict.CopyVars( *values );
+	CheckBatch();
+	return;
+    }
+
+    EnsurePythonLock guard;
+    ProcessStat( values );
+}
+
+void PythonClientUser::ProcessText( const char *data, int length )
+{
     if( P4PYDBG_CALLS )
 	cerr << "[P4] OutputText()" << endl;
     if( P4PYDBG_DATA )
@@ -286,15 +575,13 @@ void PythonClientUser::OutputText( const char *data, int length )
     else {
 	PyObject * s = specMgr->CreatePyStringAndSize(data, length);
 	if( s ) {
-	    ProcessOutput("outputText", s);
+	    ProcessOutput(OUTPUT_TEXT, s);
 	}
     }
 }
 
-void PythonClientUser::OutputInfo( char level, const char *data )
+void PythonClientUser::ProcessInfo( char level, const char *data )
 {
-    EnsurePythonLock guard;
-    
     if( P4PYDBG_CALLS )
 	cerr << "[P4] OutputInfo()" << endl;
     if( P4PYDBG_DATA )
@@ -302,14 +589,12 @@ void PythonClientUser::OutputInfo( char level, const char *data )
 
     PyObject * s = specMgr->CreatePyString(data);
     if( s ) {
-	ProcessOutput("outputInfo", s);
+	ProcessOutput(OUTPUT_INFO, s);
     }
 }
 
-void PythonClientUser::OutputBinary( const char *data, int length )
+void PythonClientUser::ProcessBinary( const char *data, int length )
 {
-    EnsurePythonLock guard;
-    
     if( P4PYDBG_CALLS )
 	cerr << "[P4] OutputBinary()" << endl;
     if( P4PYDBG_DATA )
@@ -333,13 +618,11 @@ void PythonClientUser::OutputBinary( const char *data, int length )
 
     PyObject * b = PyBytes_FromStringAndSize(data, length);
 
-    ProcessOutput("outputBinary", b);
+    ProcessOutput(OUTPUT_BINARY, b);
 }
 
-void PythonClientUser::OutputStat( StrDict *values )
+void PythonClientUser::ProcessStat( StrDict *values )
 {
-    EnsurePythonLock guard;
-    
     StrPtr *		spec 	= values->GetVar( "specdef" );
     StrPtr *		data 	= values->GetVar( "data" );
     StrPtr *		sf	= values->GetVar( "specFormatted" );
@@ -402,6 +685,17 @@ void PythonClientUser::OutputStat( StrDict *values )
 	    cerr << "[P4] OutputStat() - Converting to P4::Spec object" << endl;
 	r = specMgr->StrDictToSpec( dict, spec );
     }
+    else if( lazyRecords && owner && !results.GetColumnar() &&
+	     !specMgr->IsTyped() )
+    {
+	if( P4PYDBG_CALLS )
+	    cerr << "[P4] OutputStat() - Wrapping in P4Record" << endl;
+
+	P4Record * rec = PyObject_New(P4Record, &P4RecordType);
+	if( rec )
+	    rec->record = new PythonRecord( dict, specMgr, owner );
+	r = (PyObject *) rec;
+    }
     else
     {
 	if( P4PYDBG_CALLS )
@@ -409,7 +703,8 @@ void PythonClientUser::OutputStat( StrDict *values )
 	r = specMgr->StrDictToDict( dict );
     }
 
-    ProcessOutput("outputStat", r );
+    if( r )
+	ProcessOutput(OUTPUT_STAT, r );
 }
 
 
@@ -423,6 +718,8 @@ void PythonClientUser::OutputStat( StrDict *values )
 void PythonClientUser::Diff( FileSys *f1, FileSys *f2, int doPage, 
 				char *diffFlags, Error *e )
 {
+    FlushOutput();
+
     EnsurePythonLock guard;
     
     if ( P4PYDBG_CALLS )
@@ -489,26 +786,43 @@ void PythonClientUser::Diff( FileSys *f1, FileSys *f2, int doPage,
 
 void PythonClientUser::InputData( StrBuf *strbuf, Error *e )
 {
+    FlushOutput();
+
     EnsurePythonLock guard;
     
     if ( P4PYDBG_CALLS )
 	cerr << "[P4] InputData(). Using supplied input" << endl;
 
-    PyObject * inval = input;
+    // Lists and tuples supply one item per call, iterators are advanced
+    // one item at a time, anything else is used every time.
+
+    PyObject * inval = NULL;
 
-    if( PyTuple_Check(input) )
+    if( PyTuple_Check(input) || PyList_Check(input) )
     {
-	inval = PyTuple_GetItem(input, 0);
-	input = PyTuple_GetSlice(input, 1, PyTuple_Size(input));
+	if( inputPos < PySequence_Fast_GET_SIZE(input) )
+	    inval = PySequence_Fast_GET_ITEM(input, inputPos++);
+	Py_XINCREF(inval);
     }
-    else if ( PyList_Check(input) )
+    else if( PyIter_Check(input) )
     {
-    	inval = PyList_GetItem(input, 0);
-	input = PyList_GetSlice(input, 1, PyList_Size(input));
+	// The exception raised by the iterator is passed on to the caller
+	inval = PyIter_Next(input);
+	if( !inval && PyErr_Occurred() )
+	{
+	    e->Set( E_FAILED, "Cannot read the next item of P4.input" );
+	    return;
+	}
+    }
+    else
+    {
+	inval = input;
+	Py_INCREF(inval);
     }
     
-    if( inval == Py_None )
+    if( !inval || inval == Py_None )
     {
+	Py_XDECREF(inval);
 	PyErr_WarnEx( PyExc_UserWarning, 
 		"[P4] Expected user input, found none. "
 		"Missing call to P4.input ?", 1 );
@@ -521,6 +835,7 @@ void PythonClientUser::InputData( StrBuf *strbuf, Error *e )
 
 	specMgr->AddSpecDef( cmd.Text(), specDef->Text() );
 	specMgr->SpecToString( cmd.Text(), inval, *strbuf, e );
+	Py_DECREF(inval);
 	return;
     }
     
@@ -528,6 +843,7 @@ void PythonClientUser::InputData( StrBuf *strbuf, Error *e )
     PyObject * str = PyObject_Str(inval);
     strbuf->Set( GetPythonString(str) );
     Py_XDECREF(str);
+    Py_DECREF(inval);
 }
 
 /*
@@ -554,6 +870,7 @@ int PythonClientUser::Resolve( ClientMerge *m, Error *e )
     if ( P4PYDBG_CALLS )
         cerr << "[P4] Resolve()" << endl;
 
+    FlushOutput();
     
     EnsurePythonLock guard;
     
@@ -625,6 +942,8 @@ int PythonClientUser::Resolve( ClientResolveA *m, int preview, Error *e )
     if ( P4PYDBG_CALLS )
         cerr << "[P4] Resolve(Action)" << endl;
 
+    FlushOutput();
+
     EnsurePythonLock guard;
 
     //
@@ -657,7 +976,7 @@ int PythonClientUser::Resolve( ClientResolveA *m, int preview, Error *e )
     case CMS_YOURS:	t = "ay";	break;
     case CMS_THEIRS:	t = "at";	break;
     default:
-	cerr << "Unknown autoMerge result " << autoMerge << " encountered" << cerr;
+	cerr << "Unknown autoMerge result " << autoMerge << " encountered" << endl;
 	t = "q";
 	break;
     }
@@ -701,6 +1020,7 @@ PyObject * PythonClientUser::SetInput( PyObject * i )
 
     PyObject * tmp = input;
     input = i;
+    inputPos = 0;
     Py_INCREF(input);
     Py_DECREF(tmp);
     
@@ -724,6 +1044,45 @@ PyObject * PythonClientUser::SetResolver( PyObject * r )
     Py_RETURN_TRUE;
 }
 
+int PythonClientUser::SetFilter( const char * expr )
+{
+    P4RecordFilter * f = NULL;
+
+    if( *expr )
+    {
+	StrBuf	error;
+	f = new P4RecordFilter;
+	if( f->Compile( expr, error ) < 0 )
+	{
+	    StrBuf msg;
+	    msg << "Invalid filter '" << expr << "': " << error;
+	    PyErr_SetString( PyExc_ValueError, msg.Text() );
+	    delete f;
+	    return -1;
+	}
+    }
+
+    // A command running without the GIL may still be matching records
+    // against the old filter, so keep it until the next command starts.
+    if( filter && filter == activeFilter )
+	retiredFilters.push_back( filter );
+    else
+	delete filter;
+    filter = f;
+    return 0;
+}
+
+const char * PythonClientUser::GetFilter()
+{
+    return filter ? filter->GetText() : "";
+}
+
+void PythonClientUser::ClearHandlerMethods()
+{
+    for( int i = 0; i < OUTPUT_METHODS; i++ )
+	Py_CLEAR( handlerMethods[ i ] );
+}
+
 /*
  * Sets the callback from Python
  */
@@ -733,9 +1092,40 @@ PyObject * PythonClientUser::SetHandler( PyObject * c )
     if( P4PYDBG_CALLS )
 	cerr << "[P4] SetIterator()" << endl;
 
-    int result = PyObject_IsInstance( c, P4OutputHandler );
+    int isSink = PyObject_TypeCheck( c, &P4SinkType );
+    int result = isSink ? 1 : PyObject_IsInstance( c, P4OutputHandler );
 
     if( c == Py_None || 1 == result ) {
+	// Look the output methods up once rather than for every record.
+	// Methods replaced on the handler afterwards are not seen.
+
+	static const char * const names[ OUTPUT_METHODS ] = {
+	    "outputText", "outputBinary", "outputStat", 
+	    "outputInfo", "outputMessage",
+	    "outputStatBatch", "outputTextBatch"
+	};
+	PyObject * methods[ OUTPUT_METHODS ] = { NULL };
+
+	for( int i = 0; c != Py_None && !isSink && i < OUTPUT_METHODS; i++ )
+	{
+	    // the batch methods are optional
+	    if( i >= OUTPUT_STAT_BATCH && !PyObject_HasAttrString( c, names[ i ] ) )
+		continue;
+
+	    methods[ i ] = PyObject_GetAttrString( c, names[ i ] );
+	    if( !methods[ i ] )
+	    {
+		for( int j = 0; j < i; j++ )
+		    Py_XDECREF( methods[ j ] );
+		return NULL;
+	    }
+	}
+
+	ClearHandlerMethods();
+	for( int i = 0; i < OUTPUT_METHODS; i++ )
+	    handlerMethods[ i ] = methods[ i ];
+	sink = isSink ? ((P4Sink *) c)->sink : NULL;
+
 	PyObject * tmp = handler;
 	handler = c;
 
@@ -747,7 +1137,7 @@ PyObject * PythonClientUser::SetHandler( PyObject * c )
 	Py_RETURN_TRUE;
     }
     else if ( 0 == result ) {
-	PyErr_SetString(PyExc_TypeError, "Iterator must be an instance of P4.Iterator.");
+	PyErr_SetString(PyExc_TypeError, "Handler must be an instance of P4.OutputHandler or a P4API sink.");
     }
 
     return NULL;
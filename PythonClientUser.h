@@ -38,7 +38,11 @@
 #ifndef PYTHON_CLIENT_USER_H
 #define PYTHON_CLIENT_USER_H
 
+#include <vector>
+
 class ClientProgress;
+class PythonOutputSink;
+class P4RecordFilter;
 
 class PythonClientUser : public ClientUser, public KeepAlive
 {
@@ -67,7 +71,8 @@ class PythonClientUser : public ClientUser, public KeepAlive
 
 	virtual void	Finished();
 
-	// Local methods
+	// Local methods. GetInput() returns the input as it was set, how
+	// much of it InputData() has used is not visible.
 	PyObject * 	SetInput( PyObject * i );
 	PyObject *	GetInput() { Py_INCREF(input); return input; }
 	
@@ -83,6 +88,40 @@ class PythonClientUser : public ClientUser, public KeepAlive
         void		SetCommand( const char *c )	{ cmd = c; }
         void		SetApiLevel( int level );
         void		SetTrack(bool t)		{ track = t; }
+
+	// Batching: 0 converts each record as it arrives, n > 0 stages
+	// n records without the GIL before converting them in one go, and
+	// -1 stages everything until the command has finished.
+	void		SetBatchSize( int n )	{ batchSize = n; }
+	int		GetBatchSize()		{ return batchSize; }
+	void		FlushOutput();
+
+	// Records per call of outputStatBatch()/outputTextBatch(), 0 for
+	// the default. Independent of the staging above.
+	void		SetHandlerBatchSize( int n )	{ handlerBatchSize = n; }
+	int		GetHandlerBatchSize()		{ return handlerBatchSize; }
+
+	// Return tagged output as P4Record objects instead of dicts. Only
+	// plain records are lazy: with columnar output or typed values the
+	// setting has no effect. Records hold a reference to owner and
+	// convert through its SpecMgr.
+	void		SetLazyRecords( int l )	{ lazyRecords = l; }
+	void		SetOwner( PyObject * o ) { owner = o; }
+	int		GetLazyRecords()	{ return lazyRecords; }
+
+	// Pipelined commands: Finished() moves the output of each command
+	// to outputs and switches to the name of the next command.
+	void		SetPipeline( PyObject * outputs, int count,
+				     const char * const * cmds );
+
+	// Tagged records not matching expr are dropped before conversion,
+	// see P4RecordFilter.h. An empty expr removes the filter.
+	int		SetFilter( const char * expr );
+	const char *	GetFilter();
+	P4RecordFilter * GetRecordFilter()	{ return activeFilter; }
+
+	void		SetColumnar( int c )	{ results.SetColumnar( c ); }
+	int		GetColumnar()		{ return results.GetColumnar(); }
 	
 	P4Result& 	GetResults()		{ return results; } 
 	int	 	ErrorCount();
@@ -94,21 +133,66 @@ class PythonClientUser : public ClientUser, public KeepAlive
 	// override from KeepAlive
 	virtual int	IsAlive() { return alive; }
 
+	// Asks the server to stop sending output for the running command
+	void		Cancel() { alive = 0; }
+
     private:
+	struct StagedOutput;
+
+	StagedOutput *	Stage( int type );
+	void		CheckBatch();
+	void		ProcessText( const char *data, int length );
+	void		ProcessInfo( char level, const char *data );
+	void		ProcessBinary( const char *data, int length );
+	void		ProcessStat( StrDict *values );
+
 	PyObject *	MkMergeInfo( ClientMerge *m, StrPtr &hint );
 	PyObject *	MkActionMergeInfo( ClientResolveA *m, StrPtr &hint );
-	void		ProcessOutput( const char * method, PyObject * data);
+	// The methods of an output handler, see SetHandler()
+	enum {
+	    OUTPUT_TEXT,
+	    OUTPUT_BINARY,
+	    OUTPUT_STAT,
+	    OUTPUT_INFO,
+	    OUTPUT_MESSAGE,
+	    OUTPUT_STAT_BATCH,	// optional, see QueueBatch()/FlushBatch()
+	    OUTPUT_TEXT_BATCH,
+	    OUTPUT_METHODS
+	};
+
+	void		ProcessOutput( int method, PyObject * data);
 	void		ProcessMessage( Error * e);
-	bool		CallOutputMethod( const char * method, PyObject * data);
+	bool		CallOutputMethod( int method, PyObject * data);
+	void		ClearHandlerMethods();
+	void		QueueBatch( int method, PyObject * data );
+	void		FlushBatch();
 
     private:
 	StrBuf		cmd;
 	SpecMgr *	specMgr;
 	P4Result	results;
 	PyObject *	input;
+	Py_ssize_t	inputPos;	// next item of a list or tuple input
         PyObject *      resolver;
         PyObject *	handler;
+	PyObject *	handlerMethods[ OUTPUT_METHODS ];	// bound methods
+	PyObject *	pendingBatch;	// records waiting for a batch method
+	PythonOutputSink * sink;	// owned by handler, if it is a sink
+	P4RecordFilter * filter;
+	P4RecordFilter * activeFilter;	// the filter the running command uses
+	std::vector<P4RecordFilter *> retiredFilters;	// replaced while in use
+	int		pendingMethod;
         PyObject *	progress;
+	std::vector<StagedOutput *> staged;
+	int		stagedCount;
+	int		batchSize;
+	int		handlerBatchSize;
+	int		lazyRecords;
+	PyObject *	owner;		// borrowed, NULL without an adapter
+	PyObject *	pipeline;	// borrowed, NULL unless pipelining
+	const char * const * pipelineCmds;
+	int		pipelineCount;
+	int		pipelineNext;
 	int		debug;
  	int		apiLevel;
  	int 		alive;
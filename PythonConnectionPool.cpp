@@ -0,0 +1,394 @@
+/*
+ * PythonConnectionPool. Pool of connected P4 objects shared between threads.
+ *
+ * Copyright (c) 2013, Perforce Software, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL PERFORCE SOFTWARE, INC. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id: //depot/r13.1/p4-python/PythonConnectionPool.cpp#1 $
+ *
+ */
+
+/*******************************************************************************
+ * Name		: PythonConnectionPool.cpp
+ *
+ * Description	: Keeps a bounded number of connected P4 objects and hands
+ * 		  them out to threads. All bookkeeping is done while holding
+ * 		  the GIL; the GIL is only released while a thread waits for
+ * 		  a connection to be returned and while connecting.
+ *
+ ******************************************************************************/
+
+#include <Python.h>
+#include <bytesobject.h>
+#include "undefdups.h"
+#include "python2to3.h"
+#include <clientapi.h>
+#include <strtable.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "SpecMgr.h"
+#include "P4Result.h"
+#include "PythonClientUser.h"
+#include "PythonClientAPI.h"
+#include "PythonThreadGuard.h"
+#include "PythonConnectionPool.h"
+#include "PythonTypes.h"
+
+using namespace std;
+
+//
+// Shared by RunMany() and its worker threads. Everything in here is only
+// touched while holding the GIL.
+//
+
+struct RunManyState
+{
+    PythonConnectionPool *	pool;
+    int				count;
+    const char * const *	cmds;
+    const int *			argcs;
+    char * const * const *	argvs;
+
+    int				next;		// next command to run
+    int				running;	// worker threads still alive
+    PyObject *			results;
+    PyObject *			error;		// first checkout failure
+    PythonThreadEvent		done;
+};
+
+static void RunManyThread( void * state )
+{
+    EnsurePythonLock guard;
+
+    RunManyState * s = (RunManyState *) state;
+    s->pool->RunManyWorker( s );
+}
+
+PythonConnectionPool::PythonConnectionPool( PyObject * f, PyObject * k, int s )
+    :	factory( f ),
+	kwds( NULL ),
+	size( s ),
+	created( 0 ),
+	closed( 0 )
+{
+    Py_INCREF( factory );
+
+    if( k )
+	kwds = PyDict_Copy( k );
+}
+
+PythonConnectionPool::~PythonConnectionPool()
+{
+    // The P4 objects disconnect themselves when they are deallocated
+
+    idle.clear();
+    for( size_t i = 0; i < members.size(); i++ )
+	Py_DECREF( members[ i ] );
+
+    Py_DECREF( factory );
+    Py_XDECREF( kwds );
+}
+
+PyObject * PythonConnectionPool::Checkout()
+{
+    for( ;; )
+    {
+	if( closed )
+	{
+	    // Pass the news on to the next thread waiting for a connection
+	    available.Signal();
+	    PyErr_SetString( P4Error, "[P4.Pool.checkout()] Pool is closed." );
+	    return NULL;
+	}
+
+	if( !idle.empty() )
+	{
+	    PyObject * p4 = idle.back();
+	    idle.pop_back();
+
+	    if( !idle.empty() )
+		available.Signal();
+
+	    if( Revive( p4 ) < 0 )
+	    {
+		// Keep the slot, the server may come back later
+		idle.push_back( p4 );
+		return NULL;
+	    }
+
+	    Py_INCREF( p4 );
+	    return p4;
+	}
+
+	if( created < size )
+	    return NewConnection();
+
+	available.Wait();
+    }
+}
+
+PyObject * PythonConnectionPool::Checkin( PyObject * p4 )
+{
+    if( !IsMember( p4 ) )
+    {
+	PyErr_SetString( PyExc_ValueError,
+		"[P4.Pool.checkin()] Connection does not belong to this pool." );
+	return NULL;
+    }
+
+    if( find( idle.begin(), idle.end(), p4 ) != idle.end() )
+    {
+	PyErr_SetString( PyExc_ValueError,
+		"[P4.Pool.checkin()] Connection has already been checked in." );
+	return NULL;
+    }
+
+    if( closed )
+    {
+	PyObject * r = ((P4Adapter *) p4)->clientAPI->Connected();
+	Py_XDECREF( r );
+	if( r == Py_True )
+	    Py_XDECREF( ((P4Adapter *) p4)->clientAPI->Disconnect() );
+	Py_RETURN_NONE;
+    }
+
+    idle.push_back( p4 );
+    available.Signal();
+
+    Py_RETURN_NONE;
+}
+
+PyObject * PythonConnectionPool::Close()
+{
+    closed = 1;
+
+    for( size_t i = 0; i < idle.size(); i++ )
+    {
+	PythonClientAPI * api = ((P4Adapter *) idle[ i ])->clientAPI;
+	PyObject * r = api->Connected();
+	Py_XDECREF( r );
+	if( r == Py_True )
+	    Py_XDECREF( api->Disconnect() );
+    }
+    idle.clear();
+
+    // Wake up anybody still waiting in Checkout()
+    available.Signal();
+
+    Py_RETURN_NONE;
+}
+
+PyObject * PythonConnectionPool::RunMany( int count, const char * const * cmds,
+					   const int * argcs,
+					   char * const * const * argvs,
+					   int connections )
+{
+    RunManyState state;
+    state.pool = this;
+    state.count = count;
+    state.cmds = cmds;
+    state.argcs = argcs;
+    state.argvs = argvs;
+    state.next = 0;
+    state.running = 0;
+    state.error = NULL;
+    state.results = PyList_New( count );
+    if( !state.results )
+	return NULL;
+
+    if( connections < 1 || connections > size )
+	connections = size;
+    if( connections > count )
+	connections = count;
+
+    for( int i = 0; i < connections; i++ )
+    {
+	if( (long) PyThread_start_new_thread( RunManyThread, &state ) == -1 )
+	    break;
+	state.running++;
+    }
+
+    if( connections && !state.running )
+    {
+	Py_DECREF( state.results );
+	PyErr_SetString( P4Error,
+		"[P4.Pool.run_many()] Could not start the worker threads." );
+	return NULL;
+    }
+
+    while( state.running )
+	state.done.Wait();
+
+    // Commands left over because no connection could be checked out
+    // get the reason instead of a result
+
+    for( int i = 0; i < count; i++ )
+    {
+	if( PyList_GET_ITEM( state.results, i ) )
+	    continue;
+
+	PyObject * r = state.error ? state.error : Py_None;
+	Py_INCREF( r );
+	PyList_SET_ITEM( state.results, i, r );
+    }
+    Py_XDECREF( state.error );
+
+    return state.results;
+}
+
+//
+// Checks out a connection and runs commands on it until there are none
+// left. The output is staged for the whole command and converted in one
+// go when it has finished, so the thread only needs the GIL once per
+// command rather than once per record.
+//
+
+void PythonConnectionPool::RunManyWorker( RunManyState * s )
+{
+    PyObject * p4 = s->next < s->count ? Checkout() : NULL;
+
+    if( p4 )
+    {
+	PythonClientAPI * api = ((P4Adapter *) p4)->clientAPI;
+	int batch = api->GetBatchSize();
+	api->SetBatchSize( -1 );
+
+	while( s->next < s->count )
+	{
+	    int i = s->next++;
+	    PyObject * r = api->Run( s->cmds[ i ], s->argcs[ i ], 
+				     s->argvs[ i ] );
+	    if( !r )
+	    {
+		PyObject *type, *value, *traceback;
+		PyErr_Fetch( &type, &value, &traceback );
+		PyErr_NormalizeException( &type, &value, &traceback );
+		Py_XDECREF( type );
+		Py_XDECREF( traceback );
+		r = value;
+		if( !r )
+		{
+		    Py_INCREF( Py_None );
+		    r = Py_None;
+		}
+	    }
+	    PyList_SET_ITEM( s->results, i, r );
+	}
+
+	api->SetBatchSize( batch );
+	Py_XDECREF( Checkin( p4 ) );
+	Py_DECREF( p4 );
+    }
+    else if( PyErr_Occurred() )
+    {
+	PyObject *type, *value, *traceback;
+	PyErr_Fetch( &type, &value, &traceback );
+	PyErr_NormalizeException( &type, &value, &traceback );
+	Py_XDECREF( type );
+	Py_XDECREF( traceback );
+	if( !s->error )
+	    s->error = value;
+	else
+	    Py_XDECREF( value );
+    }
+
+    s->running--;
+    s->done.Signal();
+}
+
+//
+// Creates and connects a new P4 object. The slot is reserved before
+// connecting because Connect() releases the GIL while it talks to the
+// server.
+//
+
+PyObject * PythonConnectionPool::NewConnection()
+{
+    created++;
+
+    PyObject * args = PyTuple_New( 0 );
+    PyObject * p4 = PyObject_Call( factory, args, kwds );
+    Py_DECREF( args );
+
+    if( p4 && !PyObject_TypeCheck( p4, &P4AdapterType ) )
+    {
+	PyErr_SetString( PyExc_TypeError,
+		"[P4.Pool] Factory did not return a P4 object." );
+	Py_CLEAR( p4 );
+    }
+
+    if( p4 )
+    {
+	PyObject * r = ((P4Adapter *) p4)->clientAPI->Connect();
+	if( r == Py_False )
+	    PyErr_SetString( P4Error, "[P4.Pool] Could not connect." );
+	if( r != Py_None )
+	    Py_CLEAR( p4 );
+	Py_XDECREF( r );
+    }
+
+    if( !p4 )
+    {
+	created--;
+	available.Signal();
+	return NULL;
+    }
+
+    Py_INCREF( p4 );
+    members.push_back( p4 );
+
+    return p4;
+}
+
+//
+// Checks an idle connection before it is handed out. Connected() will
+// disconnect a connection that the server has dropped, in which case we
+// simply connect again.
+//
+
+int PythonConnectionPool::Revive( PyObject * p4 )
+{
+    PythonClientAPI * api = ((P4Adapter *) p4)->clientAPI;
+
+    PyObject * r = api->Connected();
+    if( !r )
+	return -1;
+
+    Py_DECREF( r );
+    if( r == Py_True )
+	return 0;
+
+    r = api->Connect();
+    if( r == Py_False )
+	PyErr_SetString( P4Error, "[P4.Pool] Could not reconnect." );
+    Py_XDECREF( r );
+
+    return r == Py_None ? 0 : -1;
+}
+
+int PythonConnectionPool::IsMember( PyObject * p4 )
+{
+    return find( members.begin(), members.end(), p4 ) != members.end();
+}
@@ -0,0 +1,94 @@
+/*
+ * PythonConnectionPool. Pool of connected P4 objects shared between threads.
+ *
+ * Copyright (c) 2013, Perforce Software, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL PERFORCE SOFTWARE, INC. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id: //depot/r13.1/p4-python/PythonConnectionPool.h#1 $
+ *
+ */
+
+/*******************************************************************************
+ * Name		: PythonConnectionPool.h
+ *
+ * Description	: Keeps a bounded number of connected P4 objects and hands
+ * 		  them out to threads. Connections are created on demand,
+ * 		  checked with ClientApi::Dropped() when they are handed out
+ * 		  and reconnected if the server has gone away.
+ *
+ ******************************************************************************/
+
+#ifndef PYTHONCONNECTIONPOOL_H_
+#define PYTHONCONNECTIONPOOL_H_
+
+#include <vector>
+
+struct RunManyState;
+
+class PythonConnectionPool
+{
+public:
+    PythonConnectionPool( PyObject * factory, PyObject * kwds, int size );
+    ~PythonConnectionPool();
+
+    // Blocks until a connection is available. Returns a new reference
+    // or NULL with an exception set.
+    PyObject *	Checkout();
+
+    // Hands a connection back to the pool.
+    PyObject *	Checkin( PyObject * p4 );
+
+    // Disconnects the idle connections and refuses further checkouts
+    PyObject *	Close();
+
+    // Runs independent commands on up to connections threads, each with a
+    // connection of its own. Returns a list with the result of each
+    // command, or the exception it raised.
+    PyObject *	RunMany( int count, const char * const * cmds,
+			 const int * argcs, char * const * const * argvs,
+			 int connections );
+
+    // Worker thread of RunMany()
+    void	RunManyWorker( RunManyState * state );
+
+    int		GetSize()	{ return size; }
+    int		GetIdle()	{ return (int) idle.size(); }
+    int		GetInUse()	{ return created - (int) idle.size(); }
+
+private:
+    PyObject *	NewConnection();
+    int		Revive( PyObject * p4 );
+    int		IsMember( PyObject * p4 );
+
+private:
+    PyObject *		factory;	// callable returning a new P4 object
+    PyObject *		kwds;		// attributes passed to the factory
+    std::vector<PyObject *>	members;	// every connection created
+    std::vector<PyObject *>	idle;		// borrowed from members
+    PythonThreadEvent	available;
+    int			size;
+    int			created;
+    int			closed;
+};
+
+#endif /* PYTHONCONNECTIONPOOL_H_ */
@@ -0,0 +1,365 @@
+/*
+ * PythonOutputSink. Native consumers of tagged output.
+ *
+ * Copyright (c) 2013, Perforce Software, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL PERFORCE SOFTWARE, INC. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id: //depot/r13.1/p4-python/PythonOutputSink.cpp#1 $
+ *
+ */
+
+/*******************************************************************************
+ * Name		: PythonOutputSink.cpp
+ *
+ * Description	: Output handlers implemented in C++, see PythonOutputSink.h.
+ * 		  Process() runs on the command thread without holding the
+ * 		  GIL, Result() with both the GIL and the sink's lock. Only
+ * 		  a JsonlSink converting from another encoding takes the GIL
+ * 		  in Process().
+ *
+ ******************************************************************************/
+
+#include <Python.h>
+#include <bytesobject.h>
+#include "undefdups.h"
+#include "python2to3.h"
+#include <clientapi.h>
+#include <pythread.h>
+
+#include "PythonThreadGuard.h"
+#include "PythonOutputSink.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+PythonOutputSink::PythonOutputSink()
+{
+    lock = PyThread_allocate_lock();
+}
+
+PythonOutputSink::~PythonOutputSink()
+{
+    PyThread_free_lock( lock );
+}
+
+void PythonOutputSink::OutputStat( StrDict * values, const char * e )
+{
+    PyThread_acquire_lock( lock, WAIT_LOCK );
+    if( encoding != e )
+	encoding = e;
+    Process( values );
+    PyThread_release_lock( lock );
+}
+
+PyObject * PythonOutputSink::GetResult()
+{
+    Lock();
+    PyObject * result = Result();
+    Unlock();
+    return result;
+}
+
+void PythonOutputSink::Reset()
+{
+    Lock();
+    Clear();
+    Unlock();
+}
+
+void PythonOutputSink::Close()
+{
+    Lock();
+    Finish();
+    Unlock();
+}
+
+//
+// Takes the lock from a thread holding the GIL. A command thread may be
+// holding the lock while it waits for the GIL, so we let go of the GIL
+// until the lock is ours.
+//
+
+void PythonOutputSink::Lock()
+{
+    if( PyThread_acquire_lock( lock, NOWAIT_LOCK ) )
+	return;
+
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock( lock, WAIT_LOCK );
+    Py_END_ALLOW_THREADS
+}
+
+void PythonOutputSink::Unlock()
+{
+    PyThread_release_lock( lock );
+}
+
+PyObject * PythonCountSink::Result()
+{
+    return PyLong_FromLongLong( count );
+}
+
+//
+// JsonlSink
+//
+
+PythonJsonlSink::PythonJsonlSink( FILE * f )
+    :	out( f ),
+	lines( 0 )
+{
+}
+
+PythonJsonlSink::~PythonJsonlSink()
+{
+    Finish();
+}
+
+void PythonJsonlSink::Finish()
+{
+    if( out )
+	fclose( out );
+    out = 0;
+}
+
+PyObject * PythonJsonlSink::Result()
+{
+    if( out )
+	fflush( out );
+    return PyLong_FromLongLong( lines );
+}
+
+void PythonJsonlSink::Process( StrDict * values )
+{
+    if( !out )
+	return;
+
+    // Only UTF-8 and raw text can be written without the GIL
+    if( encoding.Length() && !( encoding == "raw" ) &&
+	!( encoding == "utf8" ) && !( encoding == "utf-8" ) )
+    {
+	EnsurePythonLock guard;
+	Format( values, 1 );
+    }
+    else
+	Format( values, 0 );
+
+    fwrite( line.Text(), 1, line.Length(), out );
+    lines++;
+}
+
+void PythonJsonlSink::Format( StrDict * values, int convert )
+{
+    StrRef	var, val;
+
+    line.Clear();
+    line << "{";
+    for( int i = 0; values->GetVar( i, var, val ); i++ )
+    {
+	// Same fields StrDictToDict() leaves out
+	if( var == "specdef" || var == "func" || var == "specFormatted" )
+	    continue;
+
+	if( line.Length() > 1 )
+	    line << ", ";
+	Quote( line, var, 0 );
+	line << ": ";
+	Quote( line, val, convert );
+    }
+    line << "}\n";
+}
+
+void PythonJsonlSink::Quote( StrBuf & s, const StrPtr & text, int convert )
+{
+    if( !convert )
+    {
+	QuoteUtf8( s, text.Text(), text.Length() );
+	return;
+    }
+
+    PyObject * u = PyUnicode_Decode( text.Text(), text.Length(),
+				     encoding.Text(), "replace" );
+    PyObject * b = u ? PyUnicode_AsUTF8String( u ) : NULL;
+    if( b )
+	QuoteUtf8( s, PyBytes_AS_STRING( b ), (int) PyBytes_GET_SIZE( b ) );
+    else
+    {
+	// An unknown encoding, the text is no worse off as it is
+	PyErr_Clear();
+	QuoteUtf8( s, text.Text(), text.Length() );
+    }
+    Py_XDECREF( b );
+    Py_XDECREF( u );
+}
+
+//
+// Length of the UTF-8 sequence at p, or 0 if it is not a valid one:
+// truncated, overlong, a surrogate or beyond U+10FFFF.
+//
+
+static int Utf8Length( const unsigned char * p, int left )
+{
+    int		n;
+    unsigned	cp;
+
+    if( p[ 0 ] < 0x80 )
+	return 1;
+    else if( ( p[ 0 ] & 0xe0 ) == 0xc0 )
+	n = 2, cp = p[ 0 ] & 0x1f;
+    else if( ( p[ 0 ] & 0xf0 ) == 0xe0 )
+	n = 3, cp = p[ 0 ] & 0x0f;
+    else if( ( p[ 0 ] & 0xf8 ) == 0xf0 )
+	n = 4, cp = p[ 0 ] & 0x07;
+    else
+	return 0;
+
+    if( n > left )
+	return 0;
+
+    for( int i = 1; i < n; i++ )
+    {
+	if( ( p[ i ] & 0xc0 ) != 0x80 )
+	    return 0;
+	cp = ( cp << 6 ) | ( p[ i ] & 0x3f );
+    }
+
+    static const unsigned least[] = { 0, 0, 0x80, 0x800, 0x10000 };
+    if( cp < least[ n ] || cp > 0x10ffff || ( cp >= 0xd800 && cp <= 0xdfff ) )
+	return 0;
+
+    return n;
+}
+
+void PythonJsonlSink::QuoteUtf8( StrBuf & s, const char * p, int len )
+{
+    static const char hex[] = "0123456789abcdef";
+
+    s << "\"";
+    for( int i = 0; i < len; i++ )
+    {
+	unsigned char c = p[ i ];
+
+	if( c >= 0x80 )
+	{
+	    int n = Utf8Length( (const unsigned char *) p + i, len - i );
+	    if( n )
+	    {
+		s.Append( p + i, n );
+		i += n - 1;
+	    }
+	    else
+		s << "\\ufffd";
+	    continue;
+	}
+
+	switch( c )
+	{
+	case '"':	s << "\\\"";	break;
+	case '\\':	s << "\\\\";	break;
+	case '\n':	s << "\\n";	break;
+	case '\r':	s << "\\r";	break;
+	case '\t':	s << "\\t";	break;
+	default:
+	    if( c < 0x20 )
+	    {
+		char u[] = { '\\', 'u', '0', '0', hex[ c >> 4 ], hex[ c & 15 ], 0 };
+		s << u;
+	    }
+	    else
+		s.Extend( (char) c );
+	}
+    }
+    s << "\"";
+}
+
+//
+// FieldSetSink
+//
+
+void PythonFieldSetSink::Process( StrDict * dict )
+{
+    StrPtr * v = dict->GetVar( field );
+    if( v )
+	values.insert( string( v->Text(), v->Length() ) );
+}
+
+PyObject * PythonFieldSetSink::Result()
+{
+    PyObject * result = PySet_New( NULL );
+    if( !result )
+	return NULL;
+
+    for( set<string>::iterator i = values.begin(); i != values.end(); ++i )
+    {
+	PyObject * s = CreatePythonStringAndSize( i->data(), i->size(),
+						  encoding.Text() );
+	if( !s || PySet_Add( result, s ) < 0 )
+	{
+	    Py_XDECREF( s );
+	    Py_DECREF( result );
+	    return NULL;
+	}
+	Py_DECREF( s );
+    }
+
+    return result;
+}
+
+//
+// SumSink
+//
+
+void PythonSumSink::Process( StrDict * dict )
+{
+    StrPtr * v = dict->GetVar( field );
+    if( !v )
+	return;
+
+    char *	end;
+    errno = 0;
+    long long n = strtoll( v->Text(), &end, 10 );
+    if( end == v->Text() || *end || errno == ERANGE )
+    {
+	if( !invalid++ )
+	    example = *v;
+	return;
+    }
+
+    total += n;
+}
+
+PyObject * PythonSumSink::Result()
+{
+    if( invalid )
+    {
+	PyErr_Format( PyExc_ValueError,
+		"%lld values of %s are not integers, for example '%s'",
+		invalid, field.Text(), example.Text() );
+	return NULL;
+    }
+
+    return PyLong_FromLongLong( total );
+}
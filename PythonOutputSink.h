@@ -0,0 +1,160 @@
+/*
+ * PythonOutputSink. Native consumers of tagged output.
+ *
+ * Copyright (c) 2013, Perforce Software, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL PERFORCE SOFTWARE, INC. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id: //depot/r13.1/p4-python/PythonOutputSink.h#1 $
+ *
+ */
+
+/*******************************************************************************
+ * Name		: PythonOutputSink.h
+ *
+ * Description	: Output handlers implemented in C++. A sink set as
+ * 		  P4.handler receives the tagged output of a command as
+ * 		  StrDicts, without the GIL and without creating any Python
+ * 		  objects, and only hands a summary back to Python.
+ *
+ ******************************************************************************/
+
+#ifndef PYTHONOUTPUTSINK_H_
+#define PYTHONOUTPUTSINK_H_
+
+#include <set>
+#include <string>
+
+//
+// OutputStat() may be called from several connections at once, for example
+// by P4.Pool.run_many(), so all access goes through the sink's lock.
+// GetResult(), Reset() and Close() must be called with the GIL held; they
+// release it while they wait for a command to hand over a record. Text is
+// decoded with the P4.encoding of the connection that handed over the last
+// record.
+//
+
+class PythonOutputSink
+{
+public:
+    PythonOutputSink();
+    virtual ~PythonOutputSink();
+
+    void		OutputStat( StrDict * values, const char * encoding );
+
+    // Returns a new reference
+    PyObject *		GetResult();
+    void		Reset();
+    void		Close();
+
+protected:
+    virtual void	Process( StrDict * values ) = 0;
+    virtual PyObject *	Result() = 0;
+    virtual void	Clear() = 0;
+    virtual void	Finish() {}
+
+    StrBuf		encoding;
+
+private:
+    void		Lock();
+    void		Unlock();
+
+private:
+    PyThread_type_lock	lock;
+};
+
+// Counts the records
+class PythonCountSink : public PythonOutputSink
+{
+public:
+    PythonCountSink() : count( 0 ) {}
+
+protected:
+    void	Process( StrDict * values )	{ count++; }
+    PyObject *	Result();
+    void	Clear()		{ count = 0; }
+
+private:
+    long long	count;
+};
+
+// Writes each record as a line of JSON, in UTF-8. Text from a connection
+// with an encoding other than UTF-8 or "raw" is converted, which takes the
+// GIL; anything that is not valid UTF-8 after that is written as U+FFFD.
+class PythonJsonlSink : public PythonOutputSink
+{
+public:
+    PythonJsonlSink( FILE * out );
+    ~PythonJsonlSink();
+
+protected:
+    void	Process( StrDict * values );
+    PyObject *	Result();
+    void	Clear()		{ lines = 0; }
+    void	Finish();
+
+private:
+    void	Format( StrDict * values, int convert );
+    void	Quote( StrBuf & s, const StrPtr & text, int convert );
+    static void	QuoteUtf8( StrBuf & s, const char * p, int len );
+
+    FILE *	out;
+    long long	lines;
+    StrBuf	line;
+};
+
+// Collects the distinct values of one field
+class PythonFieldSetSink : public PythonOutputSink
+{
+public:
+    PythonFieldSetSink( const char * f ) : field( f ) {}
+
+protected:
+    void	Process( StrDict * values );
+    PyObject *	Result();
+    void	Clear()		{ values.clear(); }
+
+private:
+    StrBuf			field;
+    std::set<std::string>	values;
+};
+
+// Adds up the integer values of one field. The result raises ValueError
+// if any value was not an integer.
+class PythonSumSink : public PythonOutputSink
+{
+public:
+    PythonSumSink( const char * f ) : field( f ), total( 0 ), invalid( 0 ) {}
+
+protected:
+    void	Process( StrDict * values );
+    PyObject *	Result();
+    void	Clear()		{ total = 0; invalid = 0; }
+
+private:
+    StrBuf	field;
+    long long	total;
+    long long	invalid;	// values that were not added up
+    StrBuf	example;	// the first of them
+};
+
+#endif /* PYTHONOUTPUTSINK_H_ */
@@ -0,0 +1,190 @@
+/*
+ * PythonRecord. Lazily converted tagged output record.
+ *
+ * Copyright (c) 2013, Perforce Software, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL PERFORCE SOFTWARE, INC. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id: //depot/r13.1/p4-python/PythonRecord.cpp#1 $
+ *
+ */
+
+/*******************************************************************************
+ * Name		: PythonRecord.cpp
+ *
+ * Description	: Keeps a native copy of a tagged output record and only
+ * 		  creates Python objects for the fields that are accessed. Any
+ * 		  access that needs more than a single plain field converts
+ * 		  the whole record exactly like SpecMgr::StrDictToDict().
+ *
+ ******************************************************************************/
+
+#include <Python.h>
+#include <bytesobject.h>
+#include "undefdups.h"
+#include "python2to3.h"
+#include <clientapi.h>
+#include <strtable.h>
+
+#include "SpecMgr.h"
+#include "PythonRecord.h"
+
+#include <cstring>
+
+using namespace std;
+
+PythonRecord::PythonRecord( StrDict * v, SpecMgr * s, PyObject * o )
+    :	specMgr( s ),
+	owner( o ),
+	dict( NULL )
+{
+    StrRef	var, val;
+
+    Py_INCREF( owner );
+
+    for( int i = 0; v->GetVar( i, var, val ); i++ )
+    {
+	if( var == "specdef" || var == "func" || var == "specFormatted" )
+	    continue;
+
+	if( !specMgr->IsProjected( &var ) )
+	    continue;
+
+	values.SetVar( var, val );
+    }
+}
+
+PythonRecord::~PythonRecord()
+{
+    Py_XDECREF( dict );
+    Py_DECREF( owner );
+}
+
+//
+// Finds out whether a key maps straight onto a single variable of the
+// record. Keys that end up in lists, or that SpecMgr::InsertItem() would
+// rename, are reported as COMPLEX and need the complete conversion.
+//
+
+int PythonRecord::Lookup( const char * key, StrPtr ** value )
+{
+    StrRef	k( key );
+    StrBuf	base, index;
+
+    SpecMgr::SplitKey( &k, base, index );
+    if( index.Length() )
+	return COMPLEX;
+
+    int		klen = k.Length();
+    int		result = ABSENT;
+    StrRef	var, val;
+
+    for( int i = 0; values.GetVar( i, var, val ); i++ )
+    {
+	if( var == k )
+	{
+	    *value = values.GetVar( k );
+	    result = SCALAR;
+	    continue;
+	}
+
+	// "key0", "key1,0" and friends turn key into a list
+	if( var.Length() > klen && !strncmp( var.Text(), key, klen ) )
+	{
+	    const char * p = var.Text() + klen;
+	    while( *p && ( isdigit( (unsigned char) *p ) || *p == ',' ) )
+		p++;
+	    if( !*p )
+		return COMPLEX;
+	}
+
+	// A scalar that collides with a list is renamed to "keys"
+	if( klen > 1 && key[ klen - 1 ] == 's' && var.Length() == klen - 1 &&
+	    !strncmp( var.Text(), key, klen - 1 ) )
+	    return COMPLEX;
+    }
+
+    return result;
+}
+
+PyObject * PythonRecord::GetItem( PyObject * key )
+{
+    if( !dict && IsString( key ) )
+    {
+	StrPtr * value = 0;
+
+	switch( Lookup( GetPythonString( key ), &value ) )
+	{
+	case SCALAR:
+	    return specMgr->CreatePyString( value->Text() );
+	case ABSENT:
+	    PyErr_SetObject( PyExc_KeyError, key );
+	    return NULL;
+	}
+    }
+
+    PyObject * d = GetDict();
+    if( !d )
+	return NULL;
+
+    PyObject * item = PyDict_GetItem( d, key );
+    if( !item )
+    {
+	PyErr_SetObject( PyExc_KeyError, key );
+	return NULL;
+    }
+
+    Py_INCREF( item );
+    return item;
+}
+
+int PythonRecord::Contains( PyObject * key )
+{
+    if( !dict && IsString( key ) )
+    {
+	StrPtr * value = 0;
+	int r = Lookup( GetPythonString( key ), &value );
+	if( r != COMPLEX )
+	    return r == SCALAR;
+    }
+
+    PyObject * d = GetDict();
+    if( !d )
+	return -1;
+
+    return PyDict_Contains( d, key );
+}
+
+PyObject * PythonRecord::GetDict()
+{
+    if( dict )
+	return dict;
+
+    dict = specMgr->StrDictToDict( &values );
+
+    if( PyErr_Occurred() )
+	Py_CLEAR( dict );
+    else
+	values.Clear();
+
+    return dict;
+}
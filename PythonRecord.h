@@ -0,0 +1,71 @@
+/*
+ * PythonRecord. Lazily converted tagged output record.
+ *
+ * Copyright (c) 2013, Perforce Software, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL PERFORCE SOFTWARE, INC. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id: //depot/r13.1/p4-python/PythonRecord.h#1 $
+ *
+ */
+
+/*******************************************************************************
+ * Name		: PythonRecord.h
+ *
+ * Description	: Keeps a native copy of a tagged output record and only
+ * 		  creates Python objects for the fields that are accessed.
+ *
+ ******************************************************************************/
+
+#ifndef PYTHONRECORD_H_
+#define PYTHONRECORD_H_
+
+class PythonRecord
+{
+public:
+    // Only the fields projected by specMgr are kept, see SpecMgr::SetFields().
+    // specMgr belongs to owner, which is kept alive until the record goes.
+    PythonRecord( StrDict * values, SpecMgr * specMgr, PyObject * owner );
+    ~PythonRecord();
+
+    // Returns a new reference, or NULL with KeyError set
+    PyObject *	GetItem( PyObject * key );
+    int		Contains( PyObject * key );
+
+    // The record as a dict, the same one StrDictToDict() would have
+    // returned with the connection's settings at the time. Borrowed
+    // reference.
+    PyObject *	GetDict();
+
+private:
+    enum { ABSENT, SCALAR, COMPLEX };
+
+    int		Lookup( const char * key, StrPtr ** value );
+
+private:
+    StrBufDict	values;
+    SpecMgr *	specMgr;
+    PyObject *	owner;
+    PyObject *	dict;		// NULL until GetDict() is called
+};
+
+#endif /* PYTHONRECORD_H_ */
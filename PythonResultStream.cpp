@@ -0,0 +1,180 @@
+/*
+ * PythonResultStream. Bounded queue of results streamed from a command.
+ *
+ * Copyright (c) 2013, Perforce Software, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL PERFORCE SOFTWARE, INC. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id: //depot/r13.1/p4-python/PythonResultStream.cpp#1 $
+ *
+ */
+
+/*******************************************************************************
+ * Name		: PythonResultStream.cpp
+ *
+ * Description	: Hands the results of a command running on its own thread
+ * 		  to the Python thread iterating over them.
+ *
+ ******************************************************************************/
+
+#include <Python.h>
+#include <bytesobject.h>
+#include "undefdups.h"
+#include "python2to3.h"
+#include <clientapi.h>
+
+#include <cstring>
+
+#include "PythonThreadGuard.h"
+#include "PythonResultStream.h"
+
+using namespace std;
+
+PythonResultStream::PythonResultStream( int l )
+    :	limit( l ),
+	finished( 0 ),
+	cancelled( 0 ),
+	errType( NULL ),
+	errValue( NULL ),
+	errTraceback( NULL )
+{
+}
+
+PythonResultStream::~PythonResultStream()
+{
+    for( size_t i = 0; i < queue.size(); i++ )
+	Py_DECREF( queue[ i ] );
+
+    Py_XDECREF( errType );
+    Py_XDECREF( errValue );
+    Py_XDECREF( errTraceback );
+}
+
+PythonCommand::~PythonCommand()
+{
+    for( size_t i = 0; i < argv.size(); i++ )
+	delete [] argv[ i ];
+}
+
+void PythonCommand::SetCommand( const char *c, int argc, char * const *args )
+{
+    cmd = c;
+
+    cmdString.Clear();
+    cmdString << "\"p4 " << c;
+
+    for( int i = 0; i < argc; i++ )
+    {
+	char * a = new char[ strlen( args[ i ] ) + 1 ];
+	strcpy( a, args[ i ] );
+	argv.push_back( a );
+
+	cmdString << " " << a;
+    }
+
+    cmdString << "\"";
+}
+
+//
+// Called for every result. Blocks while the queue is full unless the
+// consumer has gone away, in which case the result is dropped.
+//
+
+void PythonResultStream::Push( PyObject * result )
+{
+    while( !cancelled && (int) queue.size() >= limit )
+	notFull.Wait();
+
+    if( cancelled )
+    {
+	Py_DECREF( result );
+	return;
+    }
+
+    queue.push_back( result );
+    notEmpty.Signal();
+}
+
+void PythonResultStream::Finish()
+{
+    finished = 1;
+    notEmpty.Signal();
+}
+
+void PythonResultStream::SaveError()
+{
+    if( PyErr_Occurred() )
+	PyErr_Fetch( &errType, &errValue, &errTraceback );
+}
+
+PyObject * PythonResultStream::Pop()
+{
+    for( ;; )
+    {
+	if( !queue.empty() )
+	{
+	    PyObject * result = queue.front();
+	    queue.pop_front();
+	    notFull.Signal();
+	    return result;
+	}
+
+	if( finished )
+	    return NULL;
+
+	notEmpty.Wait();
+    }
+}
+
+//
+// Stops accepting results and discards anything not consumed yet. The
+// command thread is woken up in case it is waiting for room in the queue.
+//
+
+void PythonResultStream::Cancel()
+{
+    cancelled = 1;
+
+    while( !queue.empty() )
+    {
+	Py_DECREF( queue.front() );
+	queue.pop_front();
+    }
+
+    notFull.Signal();
+}
+
+void PythonResultStream::Join()
+{
+    while( !finished )
+	notEmpty.Wait();
+}
+
+int PythonResultStream::RestoreError()
+{
+    if( !errType )
+	return 0;
+
+    PyErr_Restore( errType, errValue, errTraceback );
+    errType = errValue = errTraceback = NULL;
+    return 1;
+}
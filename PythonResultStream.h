@@ -0,0 +1,136 @@
+/*
+ * PythonResultStream. Bounded queue of results streamed from a command.
+ *
+ * Copyright (c) 2013, Perforce Software, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL PERFORCE SOFTWARE, INC. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id: //depot/r13.1/p4-python/PythonResultStream.h#1 $
+ *
+ */
+
+/*******************************************************************************
+ * Name		: PythonResultStream.h
+ *
+ * Description	: Hands the results of a command running on its own thread
+ * 		  to the Python thread iterating over them. The queue is
+ * 		  bounded, so the command thread blocks until the consumer
+ * 		  catches up instead of buffering the whole result set.
+ * 		  Commands running in the background without a stream are
+ * 		  tracked by PythonAsyncCommand.
+ *
+ ******************************************************************************/
+
+#ifndef PYTHONRESULTSTREAM_H_
+#define PYTHONRESULTSTREAM_H_
+
+#include <deque>
+#include <vector>
+
+//
+// The command a thread of its own runs, copied so that it outlives the
+// caller's arguments.
+//
+
+class PythonCommand
+{
+public:
+    ~PythonCommand();
+
+    void		SetCommand( const char *cmd, int argc, char * const *argv );
+    const char *	GetCommand()	{ return cmd.Text(); }
+    int			GetArgc()	{ return (int) argv.size(); }
+    char * const *	GetArgv()	{ return argv.size() ? &argv[0] : 0; }
+    const char *	GetCmdString()	{ return cmdString.Text(); }
+
+private:
+    StrBuf		cmd;
+    StrBuf		cmdString;
+    std::vector<char *>	argv;
+};
+
+//
+// All methods must be called with the GIL held. Push() and Pop() release
+// the GIL while they wait for the other side.
+//
+
+class PythonResultStream : public PythonCommand
+{
+public:
+    PythonResultStream( int limit );
+    ~PythonResultStream();
+
+    // Command thread. Push() steals the reference to the result.
+    void		Push( PyObject * result );
+    void		Finish();
+    void		SaveError();
+
+    // Consumer thread. Pop() returns a new reference, or NULL once the
+    // command has finished and every result has been consumed.
+    PyObject *		Pop();
+    void		Cancel();
+    void		Join();
+    int			RestoreError();
+
+    int			IsFinished()	{ return finished; }
+    int			IsCancelled()	{ return cancelled; }
+
+private:
+    std::deque<PyObject *>	queue;
+    PythonThreadEvent	notEmpty;
+    PythonThreadEvent	notFull;
+    int			limit;
+    int			finished;
+    int			cancelled;
+
+    // Exception raised by an output handler on the command thread
+    PyObject *		errType;
+    PyObject *		errValue;
+    PyObject *		errTraceback;
+};
+
+//
+// A command running in the background with its results collected as
+// usual. The command thread calls Finish() once it is done with the
+// connection; Join() waits for that. Abandon() marks a command that was
+// stopped because the connection is going away.
+//
+
+class PythonAsyncCommand : public PythonCommand
+{
+public:
+    PythonAsyncCommand() : finished( 0 ), abandoned( 0 ) {}
+
+    void		Finish()	{ finished = 1; done.Signal(); }
+    void		Join()		{ while( !finished ) done.Wait(); }
+    void		Abandon()	{ abandoned = 1; }
+
+    int			IsFinished()	{ return finished; }
+    int			IsAbandoned()	{ return abandoned; }
+
+private:
+    PythonThreadEvent	done;
+    int			finished;
+    int			abandoned;
+};
+
+#endif /* PYTHONRESULTSTREAM_H_ */
@@ -37,6 +37,8 @@
 #ifndef PYTHON_THREAD_GUARD_H
 #define PYTHON_THREAD_GUARD_H
 
+#include <pythread.h>
+
 
 // Guard class that releases the lock in the constructor and
 // re-acquires it again in the destructor
@@ -71,4 +73,41 @@ class EnsurePythonLock
             PyGILState_Release(gstate);
         }
 };
+
+// Event used to block one thread until another thread signals it.
+// Both Signal() and Wait() must be called with the GIL held, Wait()
+// releases the GIL while it is blocked. Signals are not counted, so
+// waiters must re-check their condition when Wait() returns.
+
+class PythonThreadEvent
+{
+    PyThread_type_lock	lock;
+    int			signalled;
+
+    public:
+	PythonThreadEvent() : signalled( 0 ) {
+	    lock = PyThread_allocate_lock();
+	    PyThread_acquire_lock( lock, WAIT_LOCK );
+	}
+
+	~PythonThreadEvent() {
+	    PyThread_free_lock( lock );
+	}
+
+	void Signal() {
+	    if( !signalled ) {
+		signalled = 1;
+		PyThread_release_lock( lock );
+	    }
+	}
+
+	void Wait() {
+	    {
+		ReleasePythonLock guard;
+		PyThread_acquire_lock( lock, WAIT_LOCK );
+	    }
+	    signalled = 0;
+	}
+};
+
 #endif // PYTHON_THREAD_GUARD_H
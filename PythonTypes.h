@@ -42,6 +42,10 @@ class PythonMergeData;
 class PythonActionMergeData;
 class P4MapMaker;
 class PythonMessage;
+class PythonConnectionPool;
+class PythonResultStream;
+class PythonRecord;
+class PythonOutputSink;
 
 /* C container for P4Adapter */
 typedef struct {
@@ -73,6 +77,32 @@ typedef struct {
     PythonMessage *msg;
 } P4Message;
 
+/* C container for Pool */
+typedef struct {
+    PyObject_HEAD
+    PythonConnectionPool *pool;
+} P4Pool;
+
+/* C container for the iterator returned by P4Adapter.run_iter() */
+typedef struct {
+    PyObject_HEAD
+    P4Adapter *adapter;
+    PythonResultStream *stream;
+} P4Iterator;
+
+/* C container for lazily converted tagged output */
+typedef struct {
+    PyObject_HEAD
+    PythonRecord *record;
+} P4Record;
+
+/* C container for the native output handlers, see PythonOutputSink.h */
+typedef struct {
+    PyObject_HEAD
+    PythonOutputSink *sink;
+} P4Sink;
+
+extern PyTypeObject P4AdapterType;
 extern PyTypeObject P4MergeDataType;
 extern PyTypeObject P4ActionMergeDataType;
 extern PyTypeObject P4MapType;
@@ -80,5 +110,9 @@ extern PyObject * P4Error;
 extern PyObject * P4OutputHandler;
 extern PyObject * P4Progress;
 extern PyTypeObject P4MessageType;
+extern PyTypeObject P4PoolType;
+extern PyTypeObject P4IteratorType;
+extern PyTypeObject P4RecordType;
+extern PyTypeObject P4SinkType;
 
 #endif
@@ -45,14 +45,98 @@ $Id: //depot/r13.1/p4-python/SpecMgr.cpp#2 $
 #include <strtable.h>
 #include "P4PythonDebug.h"
 #include "PythonSpecData.h"
+#include "PythonThreadGuard.h"
 #include "SpecMgr.h"
 
 #include <iostream>
+#include <fstream>
 #include <string>
 #include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+
+#include <vector>
 
 using namespace std;
 
+//
+// The distinct values seen for one field during the current command
+//
+
+struct InternValue {
+    unsigned int	hash;
+    StrBuf		text;
+    PyObject *		value;
+};
+
+struct InternTable {
+    InternTable( int a ) : active( a ) {}
+
+    ~InternTable()
+    {
+	Clear();
+    }
+
+    void Clear()
+    {
+	for( size_t i = 0; i < values.size(); i++ )
+	    Py_DECREF( values[ i ].value );
+	values.clear();
+    }
+
+    int				active;
+    std::vector<InternValue>	values;
+};
+
+//
+// Server supplied spec definitions, per P4PORT, kept for the life of the
+// process. level and id are the server2 protocol level and the ID of the
+// server they came from, empty until we know them. Both are only learnt
+// after the first command of a connection, so a port has one entry that
+// is checked against them rather than one entry for each server.
+//
+
+struct ServerSpecs {
+    StrBuf		port;
+    int			level;
+    StrBuf		id;
+    StrBufDict *	specs;
+};
+
+static std::vector<ServerSpecs *> servers;
+
+static ServerSpecs *
+FindServer( const StrPtr &port, int level, int create )
+{
+    for( size_t i = 0; i < servers.size(); i++ )
+	if( servers[ i ]->port == port )
+	    return servers[ i ];
+
+    if( !create )
+	return 0;
+
+    ServerSpecs * s = new ServerSpecs;
+    s->port = port;
+    s->level = level;
+    s->specs = new StrBufDict;
+    servers.push_back( s );
+
+    return s;
+}
+
+static unsigned int
+FnvHash( const char * text, int len )
+{
+    unsigned int hash = 2166136261u;
+    for( int i = 0; i < len; i++ )
+    {
+	hash ^= (unsigned char) text[ i ];
+	hash *= 16777619u;
+    }
+    return hash;
+}
+
 struct specdata {
     const char *type;
     const char *spec;
@@ -232,34 +316,90 @@ struct specdata {
     { 0, 0 }
 };
 
+PyObject *				SpecMgr::fromTimestamp = 0;
+PyObject *				SpecMgr::utc = 0;
+StrBufDict *				SpecMgr::defaultSpecs = 0;
+std::vector<SpecMgr::SpecCacheEntry *>	SpecMgr::defaultCache;
 
 SpecMgr::SpecMgr()
 {
 	debug = 0;
 	specs = 0;
+	serverLevel = 0;
+	serverIdKnown = 0;
+	keyCache = 0;
+	keyCacheCount = 0;
+	internMode = INTERN_OFF;
+	internFields = 0;
+	projection = 0;
+	typedFields = 0;
+	specClass = 0;
 	encoding = "";
+
+	if( !defaultSpecs )
+	{
+		defaultSpecs = new StrBufDict;
+		for( struct specdata *sp = &speclist[ 0 ]; sp->type; sp++ )
+			defaultSpecs->SetVar( sp->type, sp->spec );
+	}
+
 	Reset();
 }
 
 SpecMgr::~SpecMgr()
 {
 	delete specs;
+
+	if( keyCache )
+	{
+	    for( int i = 0; i < KEY_CACHE_SLOTS; i++ )
+	    {
+		delete keyCache[ i ].values;
+		Py_XDECREF( keyCache[ i ].key );
+	    }
+	    delete [] keyCache;
+	}
+
+	Py_XDECREF( internFields );
+	delete projection;
+	Py_XDECREF( typedFields );
+
+	ClearSpecCache();
+	Py_XDECREF( specClass );
 }
 
 void
 SpecMgr::AddSpecDef( const char *type, StrPtr &specDef )
 {
-	if( specs->GetVar( type ) )
+	StrPtr * old = GetSpecDef( type );
+	if( old && *old == specDef )
+		return;
+
+	if( ( old = specs->GetVar( type ) ) )
+	{
+		ForgetSpec( old );
 		specs->RemoveVar( type );
+	}
 	specs->SetVar( type, specDef );
+
+	if( server.Length() )
+	{
+		ServerSpecs * s = FindServer( server, serverLevel, 1 );
+		if( !s->id.Length() )
+			s->id = serverId;
+		s->specs->RemoveVar( type );
+		s->specs->SetVar( type, specDef );
+
+		if( cacheFile.Length() )
+			SaveCacheFile();
+	}
 }
 
 void
 SpecMgr::AddSpecDef( const char *type, const char *specDef )
 {
-	if( specs->GetVar( type ) )
-		specs->RemoveVar( type );
-	specs->SetVar( type, specDef );
+	StrRef	def( specDef );
+	AddSpecDef( type, def );
 }
 
 
@@ -269,283 +409,1225 @@ SpecMgr::Reset()
 	delete specs;
 	specs = new StrBufDict;
 
-	for( struct specdata *sp = &speclist[ 0 ]; sp->type; sp++ )
-		AddSpecDef( sp->type, sp->spec );
-
-}
+	ClearSpecCache();
 
-int
-SpecMgr::HaveSpecDef( const char *type )
-{
-	return specs->GetVar( type ) != 0;
+	server.Clear();
+	serverLevel = 0;
+	serverIdKnown = 0;
 }
 
-PyObject * SpecMgr::CreatePyString( const char * s )
+void
+SpecMgr::SetServer( const char *port )
 {
-    return CreatePythonString( s, encoding.Text() );
-}
+	StrRef	p( port );
 
-PyObject * SpecMgr::CreatePyStringAndSize(const char * text, size_t len)
-{
-    return CreatePythonStringAndSize( text, len, encoding.Text() );
-}
+	if( !p.Length() )
+		return;
 
-//
-// Convert a Perforce StrDict into a Python dict. Convert multi-level 
-// data (Files0, Files1 etc. ) into (nested) array members of the dict. 
-//
+	serverIdKnown = 0;
+	serverId.Clear();
+	server = p;
 
-PyObject * SpecMgr::StrDictToDict( StrDict *dict, PyObject * pydict )
-{
-    return StrDictToDict(dict, pydict, debug);
+	if( cacheFile.Length() && !FindServer( p, 0, 0 ) )
+		LoadCacheFile();
 }
 
-PyObject * SpecMgr::StrDictToDict( StrDict *dict, PyObject * pydict, int debug )
+void
+SpecMgr::SetServerLevel( int level )
 {
-	StrRef	var, val;
-	int		i;
-
-	if( pydict == NULL )
-		pydict = PyDict_New();
+	serverLevel = level;
 
-	// TODO: Exception in case it failed to create pydict
+	ServerSpecs * s = server.Length() ? FindServer( server, level, 0 ) : 0;
+	if( !s || s->level == level )
+		return;
 
-	for ( i = 0; dict->GetVar( i, var, val ); i++ )
+	if( s->level )
 	{
-		if ( var == "specdef" || var == "func" || var == "specFormatted" )
-			continue;
+		if( P4PYDBG_COMMANDS )
+			cerr << "[P4] Server level changed, dropping specdefs" << endl;
 
-		InsertItem( pydict, &var, &val, debug );
+		ForgetServer( s );
 	}
-	return pydict;
+
+	s->level = level;
+
+	if( cacheFile.Length() )
+		SaveCacheFile();
 }
 
 //
-// Convert a Perforce StrDict into a P4.Spec object
+// The ID is worth knowing when there is something to check against it,
+// or when what we learn may end up in the cache file for others.
 //
 
-PyObject * SpecMgr::StrDictToSpec( StrDict *dict, StrPtr *specDef )
+int
+SpecMgr::NeedServerId()
 {
-    // This converts it to a string, and then to a dict, so we go from one 
-    // type of dictionary to another, via an intermediate form (a StrBuf).
+	return server.Length() && !serverIdKnown &&
+		( cacheFile.Length() || FindServer( server, 0, 0 ) );
+}
 
-    SpecDataTable dictData( dict );
-    StrBuf form;
-	
-    Error e;
-    Spec s( specDef->Text(), "", &e );
+//
+// Called once per connection. Definitions that came from a server we
+// could not identify are never installed.
+//
 
-    if( e.Test() ) Py_RETURN_FALSE;
+void
+SpecMgr::SetServerId( const char *id )
+{
+	StrRef	i( id );
 
-    // Format the StrDict into a StrBuf object
-    s.Format( &dictData, &form );
+	serverIdKnown = 1;
+	serverId = i;
 
-    // Now parse the StrBuf into a new P4::Spec object
-    PyObject * spec = NewSpec( specDef );
-    PythonSpecData specData( spec );
+	ServerSpecs * s = server.Length() ? FindServer( server, 0, 0 ) : 0;
+	if( !s || !i.Length() )
+		return;
 
-    s.ParseNoValid( form.Text(), &specData, &e );
-    if( e.Test() ) Py_RETURN_FALSE;
+	if( s->id == i )
+	{
+		// Nothing to record while we install what we already know
 
-    // Now see if there are any extraTag fields as we'll need to
-    // add those fields into our output. Just iterate over them
-    // extracting the fields and inserting them as we go.
-    int i = 0;
-    StrRef et("extraTag" );
-    for( i = 0; ; i++ )
-    {
-		StrBuf tag;
-		StrPtr *var;
-		StrPtr *val;
+		server.Clear();
 
-		tag << et << i;
+		StrRef	var, val;
+		for( int j = 0; s->specs->GetVar( j, var, val ); j++ )
+			AddSpecDef( var.Text(), val );
 
-		if( !(var = dict->GetVar( tag ) ) )
-			break;
+		server = s->port;
+		return;
+	}
 
-		val = dict->GetVar( *var );
+	if( P4PYDBG_COMMANDS )
+		cerr << "[P4] Server ID changed, dropping specdefs" << endl;
 
-		if( !val )
-			continue;
+	// Only what this connection has learnt so far is known to be right
 
-		InsertItem( spec, var, val );
-    }
+	delete s->specs;
+	s->specs = new StrBufDict;
 
-    return spec;
+	StrRef	var, val;
+	for( int j = 0; specs->GetVar( j, var, val ); j++ )
+		s->specs->SetVar( var, val );
+
+	s->id = i;
+
+	if( cacheFile.Length() )
+		SaveCacheFile();
 }
 
-PyObject * SpecMgr::StringToSpec( const char *type, const char *form, Error *e )
+void
+SpecMgr::FreeServers()
 {
-	StrPtr * specDef = specs->GetVar( type );
-	PyObject * spec = NewSpec( specDef );
-	PythonSpecData specData( spec );
-	
-	Spec s( specDef->Text(), "", e );
+	for( size_t i = 0; i < servers.size(); i++ )
+	{
+		delete servers[ i ]->specs;
+		delete servers[ i ];
+	}
+	servers.clear();
+}
 
-	if( !e->Test() ) 
-		s.ParseNoValid( form, &specData, e );
+//
+// A different server answers on this port now, so whatever we remembered
+// about the old one may be wrong.
+//
 
-	if ( e->Test() )
-		Py_RETURN_NONE;
+void
+SpecMgr::ForgetServer( ServerSpecs *s )
+{
+	delete s->specs;
+	s->specs = new StrBufDict;
 
-	return spec;
+	delete specs;
+	specs = new StrBufDict;
+	ClearSpecCache();
 }
 
 //
-// Format routine. updates a StrBuf object with the form content. 
-// The StrBuf can then be converted to a Python string where required.
+// The cache file holds one definition per line:
 //
-void SpecMgr::SpecToString( const char *type, PyObject * pydict, StrBuf &b, Error *e )
+//	port <tab> level <tab> server ID <tab> type <tab> specdef
+//
+// Loading only picks up the current server; saving keeps the lines of
+// servers this process knows nothing about.
+//
+
+void
+SpecMgr::LoadCacheFile()
 {
-	StrBuf	buf;
-	StrPtr *	specDef = specs->GetVar( type );
+	ifstream	in( cacheFile.Text() );
+	string		line;
 
-	if ( !specDef )
+	while( getline( in, line ) )
 	{
-		e->Set( E_FAILED, "No specdef available. Cannot convert dict to a "
-				"Perforce form" );
-		return;
-	}
+		size_t t1 = line.find( '\t' );
+		size_t t2 = t1 == string::npos ? t1 : line.find( '\t', t1 + 1 );
+		size_t t3 = t2 == string::npos ? t2 : line.find( '\t', t2 + 1 );
+		size_t t4 = t3 == string::npos ? t3 : line.find( '\t', t3 + 1 );
+		if( t4 == string::npos )
+			continue;
 
-	PythonSpecData specData( pydict );
+		if( line.compare( 0, t1, server.Text() ) || t1 != (size_t) server.Length() )
+			continue;
 
-	Spec s( specDef->Text(), "", e );
-	if( e->Test() ) return;
+		int		level = atoi( line.c_str() + t1 + 1 );
+		string		id = line.substr( t2 + 1, t3 - t2 - 1 );
+		string		type = line.substr( t3 + 1, t4 - t3 - 1 );
+		StrRef		specDef( line.c_str() + t4 + 1 );
 
-	s.Format( &specData, &b );
+		ServerSpecs * s = FindServer( server, level, 1 );
+		s->id.Set( id.c_str() );
+		s->specs->RemoveVar( type.c_str() );
+		s->specs->SetVar( type.c_str(), specDef );
+	}
 }
 
-//
-// This method returns a dict describing the valid fields in the spec. To
-// make it easy on our users, we map the lowercase name to the name defined
-// in the spec (with an underscore in front). 
-// Thus, the users can always user lowercase, and if the field
-// should be in mixed case, it will be. See P4.Spec.__getattr__ and __setattr__
-//
-
-PyObject * SpecMgr::SpecFields( const char *type )
+void
+SpecMgr::SaveCacheFile()
 {
-	return SpecFields( specs->GetVar( type ) );
-}
+	// Keep what other processes learnt about other servers
 
-PyObject * SpecMgr::SpecFields( StrPtr *specDef )
-{
-	if( !specDef ) Py_RETURN_NONE;
+	ifstream	in( cacheFile.Text() );
+	string		line, keep;
 
-	PyObject * 	dict = PyDict_New();
+	while( getline( in, line ) )
+	{
+		size_t t1 = line.find( '\t' );
+		if( t1 == string::npos )
+			continue;
 
-	Error e;
+		StrBuf port;
+		port.Set( line.c_str(), (int) t1 );
+		if( !FindServer( port, 0, 0 ) )
+			keep += line + "\n";
+	}
+	in.close();
+
+	StrBuf	tmp;
+	tmp << cacheFile << ".tmp";
 
-	Spec s( specDef->Text(), "", &e );
-	if ( e.Test() ) Py_RETURN_NONE;
-	
-	for( int i = 0; i < s.Count(); i++ )
 	{
-	    //
-		// Here we abuse the fact that SpecElem::tag is public, even though it's
-		// only supposed to be public to SpecData's subclasses. It's hard to
-		// see that changing anytime soon, and it makes this so simple and
-		// reliable. So...
-		//
+		ofstream out( tmp.Text() );
+		if( !out )
+			return;
+
+		out << keep;
+
+		StrRef	var, val;
+		for( size_t i = 0; i < servers.size(); i++ )
+			for( int j = 0; servers[ i ]->specs->GetVar( j, var, val ); j++ )
+				out << servers[ i ]->port.Text() << '\t'
+				    << servers[ i ]->level << '\t'
+				    << servers[ i ]->id.Text() << '\t'
+				    << var.Text() << '\t' << val.Text() << '\n';
+	}
 
-		SpecElem * se = s.Get( i );
-		StrBuf v = se->tag;
-		StrBuf k = v;
-		
-		StrOps::Lower( k );
+#ifdef OS_NT
+	remove( cacheFile.Text() );
+#endif
+	if( rename( tmp.Text(), cacheFile.Text() ) )
+		remove( tmp.Text() );
+}
 
-		PyObject * str = CreatePyString( v.Text() );
-		if( str ) {
-		    PyDict_SetItemString(dict, k.Text(), str );
-		    Py_DECREF( str );
-		}
-		else {
-		    return NULL;
-		}
-	}
-	return dict;
+int
+SpecMgr::HaveSpecDef( const char *type )
+{
+	return GetSpecDef( type ) != 0;
 }
 
-//
-// Split a key into its base name and its index. i.e. for a key "how1,0"
-// the base name is "how" and they index is "1,0". We work backwards from
-// the end of the key looking for the first char that is neither a
-// digit, nor a comma.
-//
+StrPtr *
+SpecMgr::GetSpecDef( const char *type )
+{
+	StrPtr * specDef = specs->GetVar( type );
+	if( specDef || !defaultSpecs )
+		return specDef;
+	return defaultSpecs->GetVar( type );
+}
 
-void SpecMgr::SplitKey( const StrPtr *key, StrBuf &base, StrBuf &index )
+PyObject * SpecMgr::CreatePyString( const char * s )
 {
-	if ( key->Contains(StrRef("attr-")) == key->Text() || key->Contains(StrRef("openattr-")) == key->Text() ) {
-		base.Set( key->Text(), key->Length() );
-		index.Set( key->Text() + key->Length() );
-		return;
-	}
-	
-	base = *key;
-	index = "";
-	for ( size_t i = key->Length(); i; i-- )
-	{
-		char	prev = (*key)[ i-1 ];
-		if ( !isdigit( prev ) && prev != ',' )
-		{
-			base.Set( key->Text(), i );
-			index.Set( key->Text() + i );
-			break;
-		}
-	}
+    return CreatePythonString( s, encoding.Text() );
+}
+
+PyObject * SpecMgr::CreatePyStringAndSize(const char * text, size_t len)
+{
+    return CreatePythonStringAndSize( text, len, encoding.Text() );
 }
 
 //
-// Insert an element into the response structure. The element may need to
-// be inserted into an array nested deeply within the enclosing dict.
+// Tagged output uses the same few dozen keys over and over again, so we
+// keep the key objects in a small hash table (FNV-1a, linear probing)
+// rather than creating and hashing a new string for every field. Once
+// the table is full, new keys are simply created each time.
 //
 
-void SpecMgr::InsertItem( PyObject * dict, const StrPtr *var, const StrPtr *val )
+PyObject * SpecMgr::GetKey( const char * text, int len )
 {
-    InsertItem(dict, var, val, debug);
+    KeyCacheEntry * entry;
+    return GetKey( text, len, entry );
 }
 
-void SpecMgr::InsertItem( PyObject * dict, const StrPtr *var, const StrPtr *val , int debug)
+PyObject * SpecMgr::GetKey( const char * text, int len, KeyCacheEntry *& entry )
 {
-	StrBuf	base, index;
-	StrRef	comma( "," );
+    unsigned int hash = FnvHash( text, len );
 
-	SplitKey( var, base, index );
+    entry = 0;
 
-	// If there's no index, then we insert into the top level dict 
-	// but if the key is already defined then we need to rename the key. This
-	// is probably one of those special keys like otherOpen which can be
-	// both an array element and a scalar. The scalar comes last, so we
-	// just rename it to "otherOpens" to avoid trashing the previous key
-	// value
+    if( !keyCache )
+	keyCache = new KeyCacheEntry[ KEY_CACHE_SLOTS ]();
 
-	if ( index == "" )
+    unsigned int slot = hash & ( KEY_CACHE_SLOTS - 1 );
+    for( ; keyCache[ slot ].key; slot = ( slot + 1 ) & ( KEY_CACHE_SLOTS - 1 ) )
+    {
+	if( keyCache[ slot ].hash != hash )
+	    continue;
+
+	const char * k = GetPythonString( keyCache[ slot ].key );
+	if( !strncmp( k, text, len ) && !k[ len ] )
 	{
-		StrBuf key(*var);
+	    entry = &keyCache[ slot ];
+	    Py_INCREF( entry->key );
+	    return entry->key;
+	}
+    }
 
-		if ( PyDict_GetItemString( dict, key.Text() ))
-			key << "s";
+    if( keyCacheCount >= KEY_CACHE_MAX )
+	return CreatePythonStringAndSize( text, len );
 
-		if( P4PYDBG_DATA )
-			cerr << "... " << key.Text() << " -> " << val->Text() << endl;
+    PyObject * key = CreateInternedPythonString( text, len );
+    if( !key )
+	return NULL;
 
-		PyObject * str = CreatePyString( val->Text() );
-		if( str ) {
-		    PyDict_SetItemString( dict, key.Text(),  str);
-		    Py_DECREF( str );
-		}
-		return;
-	}
+    entry = &keyCache[ slot ];
+    entry->hash = hash;
+    entry->key = key;
+    keyCacheCount++;
 
+    Py_INCREF( key );
+    return key;
+}
+
+int SpecMgr::SetIntern( PyObject * fields )
+{
+    int		mode = INTERN_OFF;
+    PyObject *	set = 0;
+
+    if( fields == Py_True )
+	mode = INTERN_AUTO;
+    else if( IsString( fields ) )
+    {
+	mode = INTERN_FIELDS;
+	set = PyFrozenSet_New( 0 );
+	if( set && PySet_Add( set, fields ) < 0 )
+	    Py_CLEAR( set );
+    }
+    else if( fields != Py_None && fields != Py_False )
+    {
+	mode = INTERN_FIELDS;
+	set = PyFrozenSet_New( fields );
+    }
+
+    if( mode == INTERN_FIELDS && !set )
+    {
+	if( PyErr_ExceptionMatches( PyExc_TypeError ) )
+	{
+	    PyErr_Clear();
+	    PyErr_SetString( PyExc_TypeError,
+		"intern must be None, True or a list of field names" );
+	}
+	return -1;
+    }
+
+    ResetIntern();
+
+    Py_XDECREF( internFields );
+    internFields = set;
+    internMode = mode;
+
+    return 0;
+}
+
+PyObject * SpecMgr::GetIntern()
+{
+    if( internMode == INTERN_AUTO )
+	Py_RETURN_TRUE;
+
+    if( internMode == INTERN_FIELDS )
+	return PySequence_List( internFields );
+
+    Py_RETURN_NONE;
+}
+
+int SpecMgr::SetFields( PyObject * fields )
+{
+    if( fields == Py_None )
+    {
+	delete projection;
+	projection = 0;
+	fieldList.Clear();
+	return 0;
+    }
+
+    PyObject * seq = IsString( fields ) ? 0 :
+		PySequence_Fast( fields, "fields must be None or a list of field names" );
+    if( !seq )
+    {
+	if( !PyErr_Occurred() )
+	    PyErr_SetString( PyExc_TypeError, 
+		"fields must be None or a list of field names" );
+	return -1;
+    }
+
+    StrBufDict *	set = new StrBufDict;
+    StrBuf		list;
+
+    for( Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE( seq ); i++ )
+    {
+	PyObject * f = PySequence_Fast_GET_ITEM( seq, i );
+	if( !IsString( f ) )
+	{
+	    PyErr_SetString( PyExc_TypeError, "field names must be strings" );
+	    Py_DECREF( seq );
+	    delete set;
+	    return -1;
+	}
+
+	StrRef name( GetPythonString( f ) );
+	if( set->GetVar( name ) )
+	    continue;
+
+	set->SetVar( name.Text(), "1" );
+	if( list.Length() )
+	    list << ",";
+	list << name;
+    }
+    Py_DECREF( seq );
+
+    delete projection;
+    projection = set;
+    fieldList = list;
+
+    return 0;
+}
+
+PyObject * SpecMgr::GetFields()
+{
+    if( !projection )
+	Py_RETURN_NONE;
+
+    PyObject *	list = PyList_New( 0 );
+    StrRef	var, val;
+
+    for( int i = 0; list && projection->GetVar( i, var, val ); i++ )
+    {
+	PyObject * s = CreatePythonString( var.Text() );
+	if( !s || PyList_Append( list, s ) < 0 )
+	    Py_CLEAR( list );
+	Py_XDECREF( s );
+    }
+
+    return list;
+}
+
+int SpecMgr::IsProjected( const StrPtr * var )
+{
+    if( !projection || projection->GetVar( *var ) )
+	return 1;
+
+    int len = BaseLength( var );
+    if( len == var->Length() )
+	return 0;
+
+    StrRef base( var->Text(), len );
+    return projection->GetVar( base ) != 0;
+}
+
+//
+// The fields converted in typed mode unless the caller says otherwise
+//
+
+static const struct { const char * field; const char * type; } typedDefaults[] = {
+    { "rev",		"int" },
+    { "haveRev",	"int" },
+    { "headRev",	"int" },
+    { "workRev",	"int" },
+    { "change",		"int" },
+    { "headChange",	"int" },
+    { "fileSize",	"int" },
+    { "startFromRev",	"int" },
+    { "endFromRev",	"int" },
+    { "startToRev",	"int" },
+    { "endToRev",	"int" },
+    { "time",		"time" },
+    { "headTime",	"time" },
+    { "headModTime",	"time" },
+    { "Update",		"time" },
+    { "Access",		"time" },
+    { 0, 0 }
+};
+
+int SpecMgr::SetTyped( PyObject * typed )
+{
+    PyObject * table = 0;
+
+    if( typed != Py_None && typed != Py_False )
+    {
+	if( typed != Py_True && !PyDict_Check( typed ) )
+	{
+	    PyErr_SetString( PyExc_TypeError, 
+		"typed must be None, True or a dict of field types" );
+	    return -1;
+	}
+
+	table = PyDict_New();
+	for( int i = 0; table && typedDefaults[ i ].field; i++ )
+	{
+	    PyObject * t = CreatePythonString( typedDefaults[ i ].type );
+	    if( !t || PyDict_SetItemString( table, typedDefaults[ i ].field, t ) < 0 )
+		Py_CLEAR( table );
+	    Py_XDECREF( t );
+	}
+
+	if( table && typed != Py_True && PyDict_Update( table, typed ) < 0 )
+	    Py_CLEAR( table );
+
+	if( !table )
+	    return -1;
+
+	Py_ssize_t	pos = 0;
+	PyObject *	key;
+	PyObject *	value;
+
+	while( PyDict_Next( table, &pos, &key, &value ) )
+	{
+	    const char * t = IsString( value ) ? GetPythonString( value ) : "";
+	    if( !IsString( key ) || !t || 
+		( strcmp( t, "int" ) && strcmp( t, "time" ) && strcmp( t, "str" ) ) )
+	    {
+		PyErr_SetString( PyExc_ValueError, 
+		    "field types must be 'int', 'time' or 'str'" );
+		Py_DECREF( table );
+		return -1;
+	    }
+	}
+    }
+
+    Py_XDECREF( typedFields );
+    typedFields = table;
+
+    // Field types are looked up again on first use
+    if( keyCache )
+	for( int i = 0; i < KEY_CACHE_SLOTS; i++ )
+	    keyCache[ i ].type = TYPE_UNKNOWN;
+
+    return 0;
+}
+
+PyObject * SpecMgr::GetTyped()
+{
+    if( !typedFields )
+	Py_RETURN_NONE;
+
+    return PyDict_Copy( typedFields );
+}
+
+//
+// Converts the value of a typed field. Returns NULL without an exception
+// if the field is not typed or the value is not an integer, in which case
+// the caller creates a string as usual. The type is kept in the key cache
+// entry; keys that did not fit into the cache look it up every time.
+//
+
+int SpecMgr::TypeOf( PyObject * key )
+{
+    PyObject * t = PyDict_GetItem( typedFields, key );
+    const char * name = t ? GetPythonString( t ) : "str";
+
+    return !strcmp( name, "int" ) ? TYPE_INT :
+	   !strcmp( name, "time" ) ? TYPE_TIME : TYPE_STR;
+}
+
+PyObject * SpecMgr::CreateTypedValue( KeyCacheEntry * entry, PyObject * key,
+				      const StrPtr *val )
+{
+    int type;
+    if( entry )
+    {
+	if( entry->type == TYPE_UNKNOWN )
+	    entry->type = TypeOf( entry->key );
+	type = entry->type;
+    }
+    else
+	type = TypeOf( key );
+
+    if( type == TYPE_STR )
+	return NULL;
+
+    const char *	s = val->Text();
+    const char *	d = ( *s == '-' ) ? s + 1 : s;
+    char *		end;
+
+    if( !isdigit( (unsigned char) *d ) )
+	return NULL;
+
+    errno = 0;
+    long long n = strtoll( s, &end, 10 );
+    if( *end || errno )
+	return NULL;
+
+    if( type == TYPE_INT )
+	return PyLong_FromLongLong( n );
+
+    // The module has gone away, a string will have to do
+    if( !fromTimestamp )
+	return NULL;
+
+    PyObject * stamp = PyLong_FromLongLong( n );
+    if( !stamp )
+	return NULL;
+
+    PyObject * result = PyObject_CallFunctionObjArgs( fromTimestamp, stamp, utc, NULL );
+    Py_DECREF( stamp );
+
+    return result;
+}
+
+void SpecMgr::ResetIntern()
+{
+    if( !keyCache )
+	return;
+
+    for( int i = 0; i < KEY_CACHE_SLOTS; i++ )
+    {
+	delete keyCache[ i ].values;
+	keyCache[ i ].values = 0;
+    }
+}
+
+//
+// Create the value for a field, reusing the object from an earlier
+// record of the same command where possible. Fields are only interned
+// when their key is in the key cache. In automatic mode, a field that
+// turns out to have many different values is dropped from the table.
+//
+
+PyObject * SpecMgr::CreateValue( KeyCacheEntry * entry, PyObject * key,
+				  const StrPtr *val )
+{
+    if( typedFields )
+    {
+	PyObject * typed = CreateTypedValue( entry, key, val );
+	if( typed || PyErr_Occurred() )
+	    return typed;
+    }
+
+    if( internMode == INTERN_OFF || !entry )
+	return CreatePyString( val->Text() );
+
+    InternTable * t = entry->values;
+    if( !t )
+    {
+	int active = 1;
+	if( internMode == INTERN_FIELDS )
+	{
+	    active = PySet_Contains( internFields, entry->key );
+	    if( active < 0 )
+	    {
+		PyErr_Clear();
+		active = 0;
+	    }
+	}
+	t = entry->values = new InternTable( active );
+    }
+
+    if( !t->active )
+	return CreatePyString( val->Text() );
+
+    unsigned int hash = FnvHash( val->Text(), val->Length() );
+    for( size_t i = 0; i < t->values.size(); i++ )
+    {
+	InternValue & v = t->values[ i ];
+	if( v.hash == hash && v.text == *val )
+	{
+	    Py_INCREF( v.value );
+	    return v.value;
+	}
+    }
+
+    PyObject * str = CreatePyString( val->Text() );
+    if( !str )
+	return NULL;
+
+    size_t limit = internMode == INTERN_AUTO ? INTERN_AUTO_MAX : INTERN_FIELD_MAX;
+    if( t->values.size() >= limit )
+    {
+	if( internMode == INTERN_AUTO )
+	{
+	    t->Clear();
+	    t->active = 0;
+	}
+	return str;
+    }
+
+    InternValue v;
+    v.hash = hash;
+    v.text = *val;
+    v.value = str;
+    t->values.push_back( v );
+
+    Py_INCREF( str );
+    return str;
+}
+
+//
+// Convert a Perforce StrDict into a Python dict. Convert multi-level 
+// data (Files0, Files1 etc. ) into (nested) array members of the dict. 
+//
+
+PyObject * SpecMgr::StrDictToDict( StrDict *dict, PyObject * pydict )
+{
+    return StrDictToDict(dict, pydict, debug);
+}
+
+PyObject * SpecMgr::StrDictToDict( StrDict *dict, PyObject * pydict, int debug )
+{
+	StrRef	var, val;
+	int		i;
+
+	if( pydict == NULL )
+		pydict = PyDict_New();
+
+	// TODO: Exception in case it failed to create pydict
+
+	for ( i = 0; dict->GetVar( i, var, val ); i++ )
+	{
+		if ( var == "specdef" || var == "func" || var == "specFormatted" )
+			continue;
+
+		if ( projection && !IsProjected( &var ) )
+			continue;
+
+		InsertItem( pydict, &var, &val, debug );
+	}
+	return pydict;
+}
+
+//
+// Convert a Perforce StrDict into a P4.Spec object
+//
+
+PyObject * SpecMgr::StrDictToSpec( StrDict *dict, StrPtr *specDef )
+{
+    // The server has already parsed the form for us, so we walk the
+    // elements of the specdef and copy each field straight across. This
+    // matches what formatting the dict and parsing the form again would
+    // give us, without the intermediate form.
+
+    Error e;
+    SpecCacheEntry * entry = FindSpec( specDef, &e );
+
+    if( e.Test() ) Py_RETURN_FALSE;
+    if( !entry ) return NULL;
+
+    PyObject * spec = NewSpec( entry );
+    if( spec == NULL ) return NULL;
+
+    PythonSpecData specData( spec );
+    Spec * s = entry->spec;
+
+    for( int i = 0; i < s->Count(); i++ )
+    {
+	SpecElem *	se = s->Get( i );
+	StrPtr *	val;
+
+	if( se->IsList() )
+	{
+	    for( int x = 0; ( val = dict->GetVar( se->tag, x ) ); x++ )
+		specData.SetLine( se, x, val, &e );
+	    continue;
+	}
+
+	if( !( val = dict->GetVar( se->tag ) ) )
+	    continue;
+
+	// Parsing a form terminates every line of a text field
+
+	if( se->IsText() && val->Length() && (*val)[ val->Length() - 1 ] != '\n' )
+	{
+	    StrBuf text;
+	    text << *val << "\n";
+	    specData.SetLine( se, 0, &text, &e );
+	}
+	else
+	{
+	    specData.SetLine( se, 0, val, &e );
+	}
+    }
+
+    // Same as a form that fails to parse
+    if( e.Test() )
+    {
+	Py_DECREF( spec );
+	Py_RETURN_FALSE;
+    }
+
+    // Now see if there are any extraTag fields as we'll need to
+    // add those fields into our output. Just iterate over them
+    // extracting the fields and inserting them as we go.
+    int i = 0;
+    StrRef et("extraTag" );
+    for( i = 0; ; i++ )
+    {
+		StrBuf tag;
+		StrPtr *var;
+		StrPtr *val;
+
+		tag << et << i;
+
+		if( !(var = dict->GetVar( tag ) ) )
+			break;
+
+		val = dict->GetVar( *var );
+
+		if( !val )
+			continue;
+
+		InsertItem( spec, var, val );
+    }
+
+    return spec;
+}
+
+PyObject * SpecMgr::StringToSpec( const char *type, const char *form, Error *e )
+{
+	StrPtr * specDef = GetSpecDef( type );
+
+	if ( !specDef )
+	{
+		e->Set( E_FAILED, "No specdef available. Cannot convert Perforce "
+				"form to a dict" );
+		Py_RETURN_NONE;
+	}
+
+	SpecCacheEntry * entry = FindSpec( specDef, e );
+
+	if ( e->Test() )
+		Py_RETURN_NONE;
+	if ( !entry )
+		return NULL;
+
+	PyObject * spec = NewSpec( entry );
+	if ( !spec )
+		return NULL;
+
+	PythonSpecData specData( spec );
+	
+	entry->spec->ParseNoValid( form, &specData, e );
+
+	if ( e->Test() )
+	{
+		Py_DECREF( spec );
+		Py_RETURN_NONE;
+	}
+
+	return spec;
+}
+
+//
+// Format routine. updates a StrBuf object with the form content. 
+// The StrBuf can then be converted to a Python string where required.
+//
+void SpecMgr::SpecToString( const char *type, PyObject * pydict, StrBuf &b, Error *e )
+{
+	StrPtr *	specDef = GetSpecDef( type );
+
+	if ( !specDef )
+	{
+		e->Set( E_FAILED, "No specdef available. Cannot convert dict to a "
+				"Perforce form" );
+		return;
+	}
+
+	SpecCacheEntry * entry = FindSpec( specDef, e );
+	if( !entry )
+	{
+		// SpecFields() failed, Python will report the exception
+		if( !e->Test() )
+			e->Set( E_FAILED, "Cannot convert dict to a Perforce form" );
+		return;
+	}
+
+	PythonSpecData specData( pydict );
+
+	entry->spec->Format( &specData, &b );
+}
+
+//
+// The bulk routines use a Spec of their own, so nothing they touch while
+// the GIL is released is shared with other threads.
+//
+
+PyObject * SpecMgr::StringsToSpecs( const char *type, PyObject * forms, Error *e )
+{
+	StrPtr * specDef = GetSpecDef( type );
+
+	if ( !specDef )
+	{
+		e->Set( E_FAILED, "No specdef available. Cannot convert Perforce "
+				"forms to dicts" );
+		return NULL;
+	}
+
+	Spec s( specDef->Text(), "", e );
+	if ( e->Test() )
+		return NULL;
+
+	PyObject * seq = PySequence_Fast( forms, "forms must be a sequence" );
+	if ( !seq )
+		return NULL;
+
+	Py_ssize_t		count = PySequence_Fast_GET_SIZE( seq );
+	vector<StrBuf>		text( count );
+	vector<StrBuf>		comments( count );
+	vector<StrBufDict *>	tables( count );
+
+	for ( Py_ssize_t i = 0; i < count; i++ )
+	{
+		PyObject * form = PySequence_Fast_GET_ITEM( seq, i );
+		const char * t = IsString( form ) ? GetPythonString( form ) : NULL;
+		if ( !t )
+		{
+			if ( !PyErr_Occurred() )
+				PyErr_SetString( PyExc_TypeError, "forms must be strings" );
+			Py_DECREF( seq );
+			return NULL;
+		}
+		text[ i ] = t;
+	}
+	Py_DECREF( seq );
+
+	{
+		ReleasePythonLock guard;
+
+		for ( Py_ssize_t i = 0; i < count && !e->Test(); i++ )
+		{
+			// The comment is every line starting with a #
+
+			const char * p = text[ i ].Text();
+			while ( *p )
+			{
+				const char * nl = strchr( p, '\n' );
+				int len = nl ? (int)( nl - p ) : (int) strlen( p );
+				if ( *p == '#' )
+				{
+					if ( comments[ i ].Length() )
+						comments[ i ] << "\n";
+					comments[ i ].Append( p, len );
+				}
+				p += nl ? len + 1 : len;
+			}
+			comments[ i ] << "\n";
+
+			tables[ i ] = new StrBufDict;
+			SpecDataTable data( tables[ i ] );
+			s.ParseNoValid( text[ i ].Text(), &data, e );
+		}
+	}
+
+	PyObject * list = e->Test() ? NULL : PyList_New( count );
+
+	for ( Py_ssize_t i = 0; list && i < count; i++ )
+	{
+		PyObject * spec = StrDictToSpec( tables[ i ], specDef );
+		PyObject * comment = NULL;
+
+		if ( spec == Py_False )
+			e->Set( E_FAILED, "Cannot convert Perforce form" );
+		else if ( spec )
+			comment = CreatePythonString( comments[ i ].Text() );
+
+		if ( !comment || PyObject_SetAttrString( spec, "comment", comment ) < 0 )
+		{
+			Py_XDECREF( spec );
+			Py_XDECREF( comment );
+			Py_CLEAR( list );
+			break;
+		}
+		Py_DECREF( comment );
+
+		PyList_SET_ITEM( list, i, spec );
+	}
+
+	for ( Py_ssize_t i = 0; i < count; i++ )
+		delete tables[ i ];
+
+	return list;
+}
+
+PyObject * SpecMgr::SpecsToStrings( const char *type, PyObject * specs, Error *e )
+{
+	StrPtr * specDef = GetSpecDef( type );
+
+	if ( !specDef )
+	{
+		e->Set( E_FAILED, "No specdef available. Cannot convert dicts to "
+				"Perforce forms" );
+		return NULL;
+	}
+
+	Spec s( specDef->Text(), "", e );
+	if ( e->Test() )
+		return NULL;
+
+	PyObject * seq = PySequence_Fast( specs, "specs must be a sequence" );
+	if ( !seq )
+		return NULL;
+
+	// Copy the fields into native tables while we hold the GIL, reading
+	// them the same way SpecToString() does.
+
+	Py_ssize_t		count = PySequence_Fast_GET_SIZE( seq );
+	vector<StrBufDict *>	tables( count );
+	vector<StrBuf>		forms( count );
+	int			ok = 1;
+
+	for ( Py_ssize_t i = 0; ok && i < count; i++ )
+	{
+		PyObject * dict = PySequence_Fast_GET_ITEM( seq, i );
+		if ( !PyDict_Check( dict ) )
+		{
+			PyErr_SetString( PyExc_TypeError, "specs must be dictionaries" );
+			ok = 0;
+			break;
+		}
+
+		PythonSpecData	specData( dict );
+		const char *	cmt;
+		StrPtr *	val;
+
+		tables[ i ] = new StrBufDict;
+		for ( int j = 0; j < s.Count(); j++ )
+		{
+			SpecElem * se = s.Get( j );
+			if ( !se->IsList() )
+			{
+				if ( ( val = specData.GetLine( se, 0, &cmt ) ) )
+					tables[ i ]->SetVar( se->tag, *val );
+				continue;
+			}
+			for ( int x = 0; ( val = specData.GetLine( se, x, &cmt ) ); x++ )
+				tables[ i ]->SetVar( se->tag, x, *val );
+		}
+
+		// GetLine() only warns, but the warning may have been turned
+		// into an exception
+		if ( PyErr_Occurred() )
+			ok = 0;
+	}
+
+	if ( ok )
+	{
+		ReleasePythonLock guard;
+
+		for ( Py_ssize_t i = 0; i < count; i++ )
+		{
+			SpecDataTable data( tables[ i ] );
+			s.Format( &data, &forms[ i ] );
+		}
+	}
+
+	PyObject * list = ok ? PyList_New( count ) : NULL;
+
+	for ( Py_ssize_t i = 0; list && i < count; i++ )
+	{
+		// Put the comment of a P4.Spec back on top
+
+		PyObject * spec = PySequence_Fast_GET_ITEM( seq, i );
+		PyObject * attrs = PyObject_GetAttrString( spec, "__dict__" );
+		PyObject * comment = attrs ? PyDict_GetItemString( attrs, "comment" ) : NULL;
+		StrBuf	   form;
+
+		if ( !attrs )
+			PyErr_Clear();
+
+		if ( comment && IsString( comment ) )
+			form << GetPythonString( comment ) << "\n";
+		form << forms[ i ];
+		Py_XDECREF( attrs );
+
+		PyObject * str = CreatePythonString( form.Text() );
+		if ( !str )
+		{
+			Py_CLEAR( list );
+			break;
+		}
+
+		PyList_SET_ITEM( list, i, str );
+	}
+
+	Py_DECREF( seq );
+
+	for ( Py_ssize_t i = 0; i < count; i++ )
+		delete tables[ i ];
+
+	return list;
+}
+
+//
+// This method returns a dict describing the valid fields in the spec. To
+// make it easy on our users, we map the lowercase name to the name defined
+// in the spec (with an underscore in front). 
+// Thus, the users can always user lowercase, and if the field
+// should be in mixed case, it will be. See P4.Spec.__getattr__ and __setattr__
+//
+
+PyObject * SpecMgr::SpecFields( const char *type )
+{
+	StrPtr * specDef = GetSpecDef( type );
+	if( !specDef ) Py_RETURN_NONE;
+
+	Error e;
+	SpecCacheEntry * entry = FindSpec( specDef, &e );
+	if( e.Test() ) Py_RETURN_NONE;
+	if( !entry ) return NULL;
+
+	// The cached map is shared by all our P4.Spec objects
+	if( entry->fields == Py_None ) Py_RETURN_NONE;
+	return PyDict_Copy( entry->fields );
+}
+
+PyObject * SpecMgr::SpecFields( Spec *s )
+{
+	PyObject * 	dict = PyDict_New();
+	if( !dict ) return NULL;
+
+	for( int i = 0; i < s->Count(); i++ )
+	{
+	    //
+		// Here we abuse the fact that SpecElem::tag is public, even though it's
+		// only supposed to be public to SpecData's subclasses. It's hard to
+		// see that changing anytime soon, and it makes this so simple and
+		// reliable. So...
+		//
+
+		SpecElem * se = s->Get( i );
+		StrBuf v = se->tag;
+		StrBuf k = v;
+		
+		StrOps::Lower( k );
+
+		PyObject * str = CreatePyString( v.Text() );
+		if( str ) {
+		    PyDict_SetItemString(dict, k.Text(), str );
+		    Py_DECREF( str );
+		}
+		else {
+		    Py_DECREF( dict );
+		    return NULL;
+		}
+	}
+	return dict;
+}
+
+//
+// Split a key into its base name and its index. i.e. for a key "how1,0"
+// the base name is "how" and they index is "1,0". We work backwards from
+// the end of the key looking for the first char that is neither a
+// digit, nor a comma.
+//
+
+void SpecMgr::SplitKey( const StrPtr *key, StrBuf &base, StrBuf &index )
+{
+	int	len = BaseLength( key );
+
+	base.Set( key->Text(), len );
+	index.Set( key->Text() + len );
+}
+
+int SpecMgr::BaseLength( const StrPtr *key )
+{
+	const char *	k = key->Text();
+
+	if ( !strncmp( k, "attr-", 5 ) || !strncmp( k, "openattr-", 9 ) )
+		return key->Length();
+
+	for ( int i = key->Length(); i; i-- )
+	{
+		char	prev = k[ i-1 ];
+		if ( !isdigit( prev ) && prev != ',' )
+			return i;
+	}
+
+	// all digits, treat it as a plain key
+	return key->Length();
+}
+
+//
+// Insert an element into the response structure. The element may need to
+// be inserted into an array nested deeply within the enclosing dict.
+//
+
+void SpecMgr::InsertItem( PyObject * dict, const StrPtr *var, const StrPtr *val )
+{
+    InsertItem(dict, var, val, debug);
+}
+
+void SpecMgr::InsertItem( PyObject * dict, const StrPtr *var, const StrPtr *val , int debug)
+{
+	int		baseLen = BaseLength( var );
+	const char *	index = var->Text() + baseLen;
+
+	// If there's no index, then we insert into the top level dict 
+	// but if the key is already defined then we need to rename the key. This
+	// is probably one of those special keys like otherOpen which can be
+	// both an array element and a scalar. The scalar comes last, so we
+	// just rename it to "otherOpens" to avoid trashing the previous key
+	// value
+
+	KeyCacheEntry *	entry;
+
+	if ( !*index )
+	{
+		PyObject * key = GetKey( var->Text(), var->Length(), entry );
+		if( !key )
+			return;
+
+		if ( PyDict_GetItem( dict, key ) )
+		{
+			StrBuf	renamed( *var );
+			renamed << "s";
+
+			Py_DECREF( key );
+			key = GetKey( renamed.Text(), renamed.Length(), entry );
+			if( !key )
+				return;
+		}
+
+		if( P4PYDBG_DATA )
+			cerr << "... " << GetPythonString( key ) << " -> " << val->Text() << endl;
+
+		PyObject * str = CreateValue( entry, key, val );
+		if( str ) {
+		    PyDict_SetItem( dict, key,  str);
+		    Py_DECREF( str );
+		}
+		Py_DECREF( key );
+		return;
+	}
+
+	//
+	// Get or create the parent array from the dict.
 	//
-	// Get or create the parent array from the dict.
-	//
-	PyObject * list = PyDict_GetItemString( dict, base.Text() );
+	PyObject * base = GetKey( var->Text(), baseLen, entry );
+	if( !base )
+		return;
+
+	PyObject * list = PyDict_GetItem( dict, base );
 
 	if ( NULL == list )
 	{
 		list = PyList_New(0);
-		PyDict_SetItemString( dict, base.Text(), list );
+		PyDict_SetItem( dict, base, list );
 		Py_DECREF( list );
 	}
 	else if( ! PyList_Check(list) )
@@ -558,14 +1640,17 @@ void SpecMgr::InsertItem( PyObject * dict, const StrPtr *var, const StrPtr *val
 		// these cases it makes sense to keep the structure flat so we
 		// just use the raw variable name.
 		//
+		Py_DECREF( base );
+
 		if( P4PYDBG_DATA )
 			cerr << "... " << var->Text() << " -> " << val->Text() << endl;
 
-		PyObject * str = CreatePyString( val->Text() );
-		if( str ) {
-		    PyDict_SetItemString( dict, var->Text(), str );
-		    Py_DECREF( str );
-		}
+		PyObject * key = GetKey( var->Text(), var->Length(), entry );
+		PyObject * str = key ? CreateValue( entry, key, val ) : NULL;
+		if( key && str )
+		    PyDict_SetItem( dict, key, str );
+		Py_XDECREF( key );
+		Py_XDECREF( str );
 		return;
 	}
 
@@ -573,21 +1658,22 @@ void SpecMgr::InsertItem( PyObject * dict, const StrPtr *var, const StrPtr *val
 	// list of digits. For each "level" in the index, we need a containing
 	// array.
 	if( P4PYDBG_DATA )
-		cerr <<  "... " << base.Text() << " -> [";
+		cerr <<  "... " << GetPythonString( base ) << " -> [";
 
-	for( const char *c = 0 ; ( c = index.Contains( comma ) ); )
+	for( const char *c = 0 ; ( c = strchr( index, ',' ) ); )
 	{
-		StrBuf	level;
-		level.Set( index.Text(), c - index.Text() );
-		index.Set( c + 1 );
-		
 		// Found another level so we need to get/create a nested array
 		// under the current entry. We use the level as an index so that
 		// missing entries are left empty deliberately.
 
-		int levelValue = level.Atoi();
+		int levelValue = atoi( index );
 		PyObject * tlist = NULL;
 
+		if( P4PYDBG_DATA )
+			cerr << levelValue << "][";
+
+		index = c + 1;
+
 		// Since Python does not allow access to array entries beyond its size 
 		// and does not fill missing entries with None automatically as Ruby does
 		// we need to fill in the missing bits ourself
@@ -612,44 +1698,147 @@ void SpecMgr::InsertItem( PyObject * dict, const StrPtr *var, const StrPtr *val
 			}
 		}
 
-		if( P4PYDBG_DATA )
-			cerr << level.Text() << "][";
-
 		list = tlist;
 	}
 	
-	for ( int i = index.Atoi(); i > PyList_Size(list); ) {
+	for ( int i = atoi( index ); i > PyList_Size(list); ) {
 		PyList_Append( list, Py_None);
 	}
 	
 	if( P4PYDBG_DATA )
 		cerr << PyList_Size(list) << "] = " <<  val->Text() << endl;
 
-	PyObject * str = CreatePyString( val->Text() );
+	PyObject * str = CreateValue( entry, base, val );
 	if( str ) {
 	    PyList_Append( list, str );
 	    Py_DECREF( str );
 	}
+	Py_DECREF( base );
 }
 
 //
 // Create a new P4.Spec object and return it.
 //
 
-PyObject * SpecMgr::NewSpec( StrPtr *specDef )
+PyObject * SpecMgr::NewSpec( SpecCacheEntry *entry )
+{
+	if( !specClass )
+	{
+		PyObject * module = PyImport_ImportModule("P4");
+		if (module == NULL) {
+			PyErr_Clear();
+			cerr << "Cannot find module P4, using <dict> instead of P4.Spec" << endl;
+			return PyDict_New();
+		}
+
+		specClass = PyObject_GetAttrString(module, "Spec");
+		Py_DECREF(module);
+
+		if (specClass == NULL) {
+			cout << "WARNING : could not find spec !!!" << endl;
+			return NULL;
+		}
+	}
+
+	return PyObject_CallFunctionObjArgs(specClass, entry->fields, NULL);
+}
+
+//
+// Look up the cache entry for a spec definition, compiling it if needed.
+// Returns NULL with e set if the definition is invalid, or with a Python
+// exception set if the field map could not be built.
+//
+
+SpecMgr::SpecCacheEntry * SpecMgr::FindSpec( StrPtr *specDef, Error *e )
+{
+	for( size_t i = 0; i < specCache.size(); i++ )
+	{
+		if( specCache[ i ]->specDef == *specDef )
+			return specCache[ i ];
+	}
+
+	for( size_t i = 0; i < defaultCache.size(); i++ )
+	{
+		if( defaultCache[ i ]->specDef == *specDef )
+			return defaultCache[ i ];
+	}
+
+	Spec * s = new Spec( specDef->Text(), "", e );
+	if( e->Test() )
+	{
+		delete s;
+		return NULL;
+	}
+
+	PyObject * fields = SpecFields( s );
+	if( !fields )
+	{
+		delete s;
+		return NULL;
+	}
+
+	SpecCacheEntry * entry = new SpecCacheEntry;
+	entry->specDef = *specDef;
+	entry->spec = s;
+	entry->fields = fields;
+
+	// Servers often send the built-in definitions, so check against
+	// those before keeping the entry to ourselves.
+
+	int builtin = 0;
+	for( struct specdata *sp = &speclist[ 0 ]; sp->type && !builtin; sp++ )
+		builtin = ( *specDef == sp->spec );
+
+	if( builtin )
+		defaultCache.push_back( entry );
+	else
+		specCache.push_back( entry );
+
+	return entry;
+}
+
+//
+// Drop the cache entry of a spec definition that has been replaced
+//
+
+void SpecMgr::ForgetSpec( StrPtr *specDef )
+{
+	for( size_t i = 0; i < specCache.size(); i++ )
+	{
+		if( specCache[ i ]->specDef == *specDef )
+		{
+			Py_DECREF( specCache[ i ]->fields );
+			delete specCache[ i ]->spec;
+			delete specCache[ i ];
+			specCache.erase( specCache.begin() + i );
+			return;
+		}
+	}
+}
+
+void SpecMgr::FreeDefaults()
 {
-	PyObject * module = PyImport_ImportModule("P4");
-	if (module == NULL) {
-		cerr << "Cannot find module P4, using <dict> instead of P4.Spec" << endl;
-		return PyDict_New();
+	for( size_t i = 0; i < defaultCache.size(); i++ )
+	{
+		Py_DECREF( defaultCache[ i ]->fields );
+		delete defaultCache[ i ]->spec;
+		delete defaultCache[ i ];
 	}
+	defaultCache.clear();
 
-	PyObject * 	fields = SpecFields( specDef );
-	PyObject * newObj = PyObject_CallMethod(module, (char*)"Spec", (char*)"(O)", fields);
-	if (newObj == NULL) {
-		cout << "WARNING : could not find spec !!!" << endl;
+	delete defaultSpecs;
+	defaultSpecs = 0;
+}
+
+void SpecMgr::ClearSpecCache()
+{
+	for( size_t i = 0; i < specCache.size(); i++ )
+	{
+		Py_DECREF( specCache[ i ]->fields );
+		delete specCache[ i ]->spec;
+		delete specCache[ i ];
 	}
-	return newObj;
+	specCache.clear();
 }
 
 #if PY_MAJOR_VERSION >= 3
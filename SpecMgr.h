@@ -39,7 +39,12 @@ $Id: //depot/r13.1/p4-python/SpecMgr.h#1 $
 #ifndef SPEC_MGR_H
 #define SPEC_MGR_H
 
+#include <vector>
+
 class StrBufDict;
+class Spec;
+struct InternTable;
+struct ServerSpecs;
 
 class SpecMgr 
 {
@@ -55,6 +60,45 @@ public:
 	PyObject * CreatePyString(const char * text);
 	PyObject * CreatePyStringAndSize(const char * text, size_t len);
 
+	// Returns a new reference to the dict key for the first len chars
+	// of text. Keys are interned and cached across records and commands.
+	PyObject * GetKey(const char * text, int len);
+
+	//
+	// Share the string objects of repeated values. fields is None (off),
+	// True (every field until it has more than INTERN_AUTO_MAX distinct
+	// values) or an iterable of field names. The tables are emptied at
+	// the start of every command by ResetIntern().
+	//
+	int		SetIntern( PyObject * fields );
+	PyObject *	GetIntern();
+	void		ResetIntern();
+
+	//
+	// Field projection. fields is None (every field) or an iterable of
+	// field names; tagged output then only keeps those fields, matched
+	// on the name without its index, so "otherOpen" keeps otherOpen0...
+	//
+	int		SetFields( PyObject * fields );
+	PyObject *	GetFields();
+	const StrPtr *	GetFieldList()	{ return projection ? &fieldList : 0; }
+	int		IsProjected( const StrPtr * var );
+
+	//
+	// Typed values. typed is None (strings only), True (the built-in
+	// table of numeric and epoch time fields) or a dict of field name to
+	// "int", "time" or "str", which is applied on top of the built-in
+	// table. Values that are not integers stay strings, so a field can
+	// mix both: "change" is "default" for files opened in the default
+	// changelist and an int otherwise. Times are converted by the
+	// datetime function the module passes to SetTimeConverter().
+	//
+	int		SetTyped( PyObject * typed );
+	PyObject *	GetTyped();
+	int		IsTyped()	{ return typedFields != 0; }
+	static void	SetTimeConverter( PyObject * fromTimestamp, PyObject * utc )
+			{ SpecMgr::fromTimestamp = fromTimestamp; SpecMgr::utc = utc; }
+
 	// Clear the spec cache and revert to internal defaults
 	void	Reset();
 
@@ -65,6 +109,26 @@ public:
 	// Check that a type of spec is known.
 	int	HaveSpecDef( const char *type );
 
+	//
+	// Server supplied definitions are remembered per P4PORT for the life
+	// of the process, and in the cache file if there is one, so they
+	// survive Reset(). SetServer() only picks the port; what we know
+	// about it is installed by SetServerId() once the ID matches the one
+	// it was learnt from, until then the built-in definitions apply.
+	// SetServerLevel() and SetServerId() forget it if a different server
+	// answers on that port now. NeedServerId() tells the caller when to
+	// find out the server's ID. FreeServers() releases all of it when
+	// the module goes away.
+	//
+	void		SetServer( const char *port );
+	void		SetServerLevel( int level );
+	void		SetServerId( const char *id );
+	int		NeedServerId();
+	static void	FreeServers();
+	static void	FreeDefaults();
+	void		SetCacheFile( const char *f )	{ cacheFile = f; }
+	const char *	GetCacheFile()			{ return cacheFile.Text(); }
+
 	//
 	// Parse routine: converts strings into Python P4.Spec objects.
 	//
@@ -76,6 +140,15 @@ public:
 	//
 	void	SpecToString(const char *type, PyObject * pydict, StrBuf &b, Error *e);
 
+	//
+	// Bulk versions of the two routines above. The definition is compiled
+	// once and the forms are parsed or formatted with the GIL released.
+	// Comments are handled like P4.parse_<spec>() and format_<spec>() do.
+	// Both return a new list, or NULL with e or a Python exception set.
+	//
+	PyObject * StringsToSpecs( const char *type, PyObject * forms, Error *e );
+	PyObject * SpecsToStrings( const char *type, PyObject * specs, Error *e );
+
 	//
 	// Convert a Perforce StrDict into a Python dict. Used when we're 
 	// parsing tagged output that is NOT a spec. e.g. output of
@@ -99,18 +172,86 @@ public:
 	//
 	PyObject * SpecFields( const char *type );
 
+	//
+	// Split a key like "how1,0" into its base name and its index
+	//
+	static void	SplitKey( const StrPtr *key, StrBuf &base, StrBuf &index );
+	static int	BaseLength( const StrPtr *key );
+
 private:
 
-	static void	SplitKey( const StrPtr *key, StrBuf &base, StrBuf &index );
 	void	InsertItem( PyObject * pydict, const StrPtr *var, const StrPtr *val );
 	void	InsertItem( PyObject * pydict, const StrPtr *var, const StrPtr *val, int debug );
-	PyObject * NewSpec( StrPtr *specDef );
-	PyObject * SpecFields( StrPtr *specDef );
+	//
+	// Everything we derive from a spec definition, cached by content.
+	// The definition is only parsed again when it changes.
+	//
+	struct SpecCacheEntry {
+	    StrBuf	specDef;
+	    Spec *	spec;		// compiled definition
+	    PyObject *	fields;		// lower case name -> field name
+	};
+
+	PyObject * NewSpec( SpecCacheEntry *entry );
+	PyObject * SpecFields( Spec *spec );
+
+	StrPtr *	GetSpecDef( const char *type );
+	SpecCacheEntry * FindSpec( StrPtr *specDef, Error *e );
+	void		ForgetSpec( StrPtr *specDef );
+	void		ClearSpecCache();
+
+	void		ForgetServer( ServerSpecs *s );
+	void		LoadCacheFile();
+	void		SaveCacheFile();
 	
 private:
+	enum { KEY_CACHE_SLOTS = 4096, KEY_CACHE_MAX = 3072 };
+	enum { INTERN_OFF, INTERN_FIELDS, INTERN_AUTO };
+	enum { INTERN_AUTO_MAX = 32, INTERN_FIELD_MAX = 256 };
+	enum { TYPE_UNKNOWN, TYPE_STR, TYPE_INT, TYPE_TIME };
+
+	struct KeyCacheEntry {
+	    unsigned int	hash;
+	    PyObject *		key;
+	    InternTable *	values;	// per command, see CreateValue()
+	    int			type;	// looked up in typedFields on first use
+	};
+
+	PyObject * GetKey( const char * text, int len, KeyCacheEntry *& entry );
+	PyObject * CreateValue( KeyCacheEntry * entry, PyObject * key,
+				const StrPtr *val );
+	PyObject * CreateTypedValue( KeyCacheEntry * entry, PyObject * key,
+				     const StrPtr *val );
+	int	   TypeOf( PyObject * key );
+
 	StrBuf		encoding;
 	int		debug;
-	StrBufDict *	specs;
+	StrBufDict *	specs;		// server supplied, overrides the defaults
+	StrBuf		server;		// P4PORT the specs came from
+	int		serverLevel;
+	int		serverIdKnown;	// checked for this connection
+	StrBuf		serverId;	// empty unless known
+	StrBuf		cacheFile;
+	KeyCacheEntry *	keyCache;	// open addressing, allocated on demand
+	int		keyCacheCount;
+	int		internMode;
+	PyObject *	internFields;	// frozenset for INTERN_FIELDS
+	StrBufDict *	projection;	// NULL unless fields are projected
+	PyObject *	typedFields;	// dict of field name to type, or NULL
+	StrBuf		fieldList;	// the projected fields, comma separated
+	std::vector<SpecCacheEntry *>	specCache;
+
+	// Borrowed from the module state, NULL once the module is cleared
+	static PyObject *			fromTimestamp;
+	static PyObject *			utc;
+
+	// The built-in definitions and their cache entries are shared by
+	// all instances and never change. Each definition is compiled once
+	// per process, by the first instance that needs it, and all of it is
+	// released by FreeDefaults() when the module goes away.
+	static StrBufDict *			defaultSpecs;
+	static std::vector<SpecCacheEntry *>	defaultCache;
+	PyObject *	specClass;	// P4.Spec, looked up on first use
 };
 
 #endif
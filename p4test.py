@@ -553,6 +553,34 @@ class TestP4(TestP4Python):
 			for thread in threads:
 					thread.join()
 
+	def testPool( self ):
+			import threading
+			
+			pool = P4.Pool( 2, port=self.port )
+			with pool.connection() as p4:
+					self.assertTrue( p4.connected(), "Pooled connection is not connected" )
+					first = p4
+			self.assertEqual( pool.idle, 1, "Connection was not returned to the pool" )
+			with pool.connection() as p4:
+					self.assertTrue( p4 is first, "Idle connection was not reused" )
+			
+			results = []
+			def worker():
+					with pool.connection() as p4:
+							results.append( p4.run_info()[0]['serverRoot'] )
+			
+			threads = [ threading.Thread( target=worker ) for i in range(8) ]
+			for thread in threads:
+					thread.start()
+			for thread in threads:
+					thread.join()
+			
+			self.assertEqual( len(results), 8, "Not all pooled commands completed" )
+			self.assertTrue( pool.in_use == 0 and pool.idle <= 2, "Pool lost track of connections" )
+			
+			pool.close()
+			self.assertRaises( P4.P4Exception, pool.checkout )
+
 	def testArguments( self ):
 		p4 = P4.P4(debug=3, port="9999", client="myclient")
 		self.assertEqual(p4.debug, 3)
@@ -669,6 +697,696 @@ class TestP4(TestP4Python):
 		self.p4.handler = None
 		self.assertEqual( sys.getrefcount(h), 2 )
 
+	def testBatchSize( self ):
+		self.assertEqual( self.p4.batch_size, 0, "Output is batched by default" )
+		
+		self.p4.connect()
+		self._setClient()
+		
+		testDir = 'test-batch'
+		files = self.createFiles(testDir)
+		
+		change = self.p4.fetch_change()
+		change._description = "My Batch Test"
+		self._doSubmit("Failed to submit the add", change)
+		
+		expected = self.p4.run_files('...')
+		for size in (1, 2, -1):
+			self.p4.batch_size = size
+			self.assertEqual( self.p4.run_files('...'), expected, "Batch size %d changed the results" % size )
+		
+		# warnings are still reported after the records that preceded them
+		self.assertRaises( P4.P4Exception, self.p4.run_files, '...', 'nonexistent/...' )
+		self.assertEqual( len(self.p4.warnings), 1, "Expected one warning" )
+		
+		class StatHandler(P4.OutputHandler):
+			def __init__(self):
+				P4.OutputHandler.__init__(self)
+				self.statOutput = []
+			
+			def outputStat(self, stat):
+				self.statOutput.append(stat)
+				return P4.OutputHandler.HANDLED
+		
+		h = StatHandler()
+		self.p4.batch_size = 2
+		with self.p4.using_handler(h):
+			self.assertEqual( len(self.p4.run_files('...')), 0, "Handled output was returned" )
+		self.assertEqual( len(h.statOutput), len(files), "Handler missed staged records" )
+
+	def testLazyRecords( self ):
+		self.assertEqual( self.p4.lazy_records, 0, "Lazy records are disabled by default" )
+		
+		self.p4.connect()
+		self._setClient()
+		
+		testDir = 'test-lazy'
+		files = self.createFiles(testDir)
+		
+		change = self.p4.fetch_change()
+		change._description = "My Lazy Test"
+		self._doSubmit("Failed to submit the add", change)
+		
+		expected = self.p4.run_fstat('...')
+		self.p4.lazy_records = 1
+		records = self.p4.run_fstat('...')
+		self.assertEqual( len(records), len(expected), "Wrong number of records" )
+		for rec, exp in zip(records, expected):
+			self.assertTrue( isinstance(rec, P4.Mapping), "Record is not a Mapping" )
+			self.assertEqual( rec['depotFile'], exp['depotFile'], "Wrong depotFile" )
+			self.assertTrue( 'headRev' in rec, "headRev is missing" )
+			self.assertFalse( 'noSuchField' in rec, "Unexpected field" )
+			self.assertRaises( KeyError, lambda: rec['noSuchField'] )
+			self.assertEqual( rec.get('noSuchField', 42), 42, "Wrong default" )
+			self.assertEqual( len(rec), len(exp), "Wrong number of fields" )
+			self.assertEqual( dict(rec), exp, "Record differs from dict" )
+			self.assertEqual( rec, exp, "Record does not compare equal" )
+		
+		# list-valued fields are still turned into lists
+		log = self.p4.run_filelog('...')
+		self.assertEqual( len(log), len(files), "Filelog failed with lazy records" )
+		self.assertEqual( log[0].revisions[0].rev, 1, "Wrong revision" )
+		self.p4.lazy_records = 0
+
+		# columnar output is never lazy
+		self.assertEqual( self.p4.run_fstat('...', lazy_records=1, columnar=1),
+			self.p4.run_fstat('...', columnar=1), "Columnar output changed by lazy_records" )
+
+		# records keep their connection alive for the conversion
+		depotPath = "//depot/" + testDir + "/..."
+		p4 = P4.P4()
+		p4.port = self.port
+		p4.connect()
+		records = p4.run_files(depotPath, lazy_records=1)
+		p4.disconnect()
+		del p4
+		self.assertEqual( [ dict(r) for r in records ], self.p4.run_files(depotPath),
+			"Record lost its connection" )
+
+	def testColumnar( self ):
+		self.assertEqual( self.p4.columnar, 0, "Columnar output is disabled by default" )
+		
+		self.p4.connect()
+		self._setClient()
+		
+		testDir = 'test-columnar'
+		files = self.createFiles(testDir)
+		
+		change = self.p4.fetch_change()
+		change._description = "My Columnar Test"
+		self._doSubmit("Failed to submit the add", change)
+		
+		self.p4.run_edit(files[0])
+		
+		expected = self.p4.run_fstat('...')
+		result = self.p4.run_fstat('...', columnar=True)
+		self.assertEqual( self.p4.columnar, 0, "columnar was not restored" )
+		self.assertEqual( len(result), 1, "Expected a single dict of columns" )
+		columns = result[0]
+		self.assertEqual( columns['depotFile'], [r['depotFile'] for r in expected], "Wrong depotFile column" )
+		self.assertEqual( columns['action'], [r.get('action') for r in expected], "Missing tags are not None" )
+		
+		columns = self.p4.run_fstat('...', columnar=2)[0]
+		self.assertEqual( columns['headRev'].tolist(), [int(r['headRev']) for r in expected], "Wrong typed column" )
+		self.assertTrue( columns['headRev'].typecode in ('q', 'l'), "Wrong typecode" )
+		self.assertTrue( isinstance(columns['depotFile'], list), "Text column was typed" )
+		
+		# Output without tagged records is left alone
+		self.assertEqual( self.p4.run_counters(tagged=0, columnar=True), self.p4.run_counters(tagged=0),
+			"Untagged output changed" )
+
+		self.p4.run_revert('...')
+
+	def testKeyCache( self ):
+		self.p4.connect()
+		self._setClient()
+		
+		testDir = 'test-keys'
+		files = self.createFiles(testDir)
+		
+		change = self.p4.fetch_change()
+		change._description = "My Key Test"
+		self._doSubmit("Failed to submit the add", change)
+		
+		first = self.p4.run_files('...')
+		second = self.p4.run_fstat('...')
+		for rec in first[1:] + second:
+			for key in first[0]:
+				if key in rec:
+					other = [k for k in rec if k == key][0]
+					self.assertTrue( other is key, "Key %s is not shared" % key )
+
+	def testIntern( self ):
+		self.assertEqual( self.p4.intern, None, "Interning is disabled by default" )
+		
+		self.p4.connect()
+		self._setClient()
+		
+		testDir = 'test-intern'
+		files = self.createFiles(testDir)
+		
+		change = self.p4.fetch_change()
+		change._description = "My Intern Test"
+		self._doSubmit("Failed to submit the add", change)
+		
+		expected = self.p4.run_fstat('...')
+		
+		self.p4.intern = ['headAction', 'headType']
+		self.assertEqual( sorted(self.p4.intern), ['headAction', 'headType'], "Wrong intern fields" )
+		records = self.p4.run_fstat('...')
+		self.assertEqual( records, expected, "Interning changed the results" )
+		self.assertTrue( records[0]['headAction'] is records[1]['headAction'], "headAction is not shared" )
+		self.assertFalse( records[0]['depotFile'] is records[1]['depotFile'], "depotFile is shared" )
+		
+		self.p4.intern = True
+		records = self.p4.run_fstat('...')
+		self.assertEqual( records, expected, "Automatic interning changed the results" )
+		self.assertTrue( records[0]['headType'] is records[1]['headType'], "headType is not shared" )
+		
+		self.p4.intern = None
+		self.assertRaises( TypeError, setattr, self.p4, 'intern', 42 )
+
+	def testSpecConversion( self ):
+		self.p4.connect()
+		self._setClient()
+		
+		testDir = 'test-specs'
+		files = self.createFiles(testDir)
+		
+		change = self.p4.fetch_change()
+		change._description = "My Spec Test\nwith a second line\n"
+		self._doSubmit("Failed to submit the add", change)
+		
+		changes = self.p4.run_changes('-m1')
+		submitted = self.p4.fetch_change(changes[0]['change'])
+		self.assertEqual( submitted._description, change._description, "Description changed" )
+		self.assertEqual( len(submitted._files), len(files), "Wrong number of files" )
+		self.assertEqual( self.p4.parse_change(self.p4.format_change(submitted)), submitted,
+				  "Spec differs from the parsed form" )
+		
+		client = self.p4.fetch_client()
+		self.assertEqual( self.p4.parse_client(self.p4.format_client(client)), client,
+				  "Client differs from the parsed form" )
+
+		# Changing the permitted fields of one spec leaves the others alone
+		client.permitted_fields().clear()
+		self.assertTrue( 'description' in self.p4.fetch_client().permitted_fields(),
+				 "Permitted fields are shared" )
+
+	def testSpecCacheFile( self ):
+		cache = os.path.join(self.server_root, 'specs.cache')
+		self.p4.spec_cache_file = cache
+		self.p4.connect()
+		
+		jobspec = self.p4.fetch_jobspec()
+		jobspec._fields.append('110 MyField word 32 optional')
+		self.p4.save_jobspec(jobspec)
+		self.p4.fetch_job()
+		
+		form = "Job: new\nStatus: open\nUser: %s\nDescription:\n\tCached\n\nMyField: cached\n" % self.p4.user
+		self.assertEqual( self.p4.parse_job(form)['MyField'], 'cached', "jobspec was not updated" )
+		
+		# Remembered definitions are only used once the first command has
+		# shown that the same server answers
+		self.p4.disconnect()
+		self.p4.connect()
+		self.p4.run_info()
+		self.assertEqual( self.p4.parse_job(form)['MyField'], 'cached', "jobspec lost on reconnect" )
+		
+		p4 = P4.P4()
+		p4.port = self.port
+		p4.spec_cache_file = cache
+		p4.connect()
+		p4.run_info()
+		self.assertEqual( p4.parse_job(form)['MyField'], 'cached', "jobspec not read from the cache file" )
+		p4.disconnect()
+
+		# Lines are port, level, server ID, type and specdef
+		with open(cache) as f:
+			lines = [ l.split('\t', 4) for l in f.read().splitlines() ]
+		self.assertTrue( all(len(l) == 5 and l[2] for l in lines), "Server ID missing from the cache file" )
+		serverId = lines[0][2]
+
+		# Definitions from another server on the same port are dropped
+		with open(cache, 'w') as f:
+			for l in lines:
+				f.write('\t'.join(l[:2] + ['another server'] + l[3:]) + '\n')
+		p4 = P4.P4()
+		p4.port = self.port
+		p4.spec_cache_file = cache
+		p4.connect()
+		p4.run_info()
+		p4.fetch_job()
+		p4.disconnect()
+		with open(cache) as f:
+			ids = set( l.split('\t', 4)[2] for l in f.read().splitlines() )
+		self.assertEqual( ids, set([serverId]), "Definitions of another server were kept" )
+
+	def testBulkSpecs( self ):
+		self.p4.connect()
+		self._setClient()
+		
+		client = self.p4.fetch_client()
+		forms = []
+		for n in range(3):
+			client._client = "bulk-%d" % n
+			client._description = "Bulk client %d\n" % n
+			forms.append(self.p4.format_client(client))
+		
+		specs = self.p4.parse_specs('client', forms)
+		self.assertEqual( len(specs), len(forms), "Wrong number of specs" )
+		for form, spec in zip(forms, specs):
+			self.assertEqual( spec, self.p4.parse_client(form), "Bulk parse differs" )
+			self.assertEqual( spec.comment, self.p4.parse_client(form).comment, "Comments differ" )
+		
+		self.assertEqual( self.p4.format_specs('client', specs),
+				  [self.p4.format_client(s) for s in specs], "Bulk format differs" )
+		self.assertRaises( TypeError, self.p4.parse_specs, 'client', [42] )
+
+	def testRunPipelined( self ):
+		self.p4.connect()
+		self._setClient()
+		
+		testDir = 'test-pipelined'
+		files = self.createFiles(testDir)
+		
+		change = self.p4.fetch_change()
+		change._description = "My Pipelined Test"
+		self._doSubmit("Failed to submit the add", change)
+		
+		depotFiles = [ f['depotFile'] for f in self.p4.run_files('...') ]
+		commands = [ ('fstat', f) for f in depotFiles ]
+		results = self.p4.run_pipelined(commands, 2)
+		self.assertEqual( len(results), len(commands), "Expected one result per command" )
+		for c, r in zip(commands, results):
+			self.assertEqual( r, self.p4.run(*c), "Pipelined result differs from run()" )
+		
+		clients = [ c for c in self.p4.iterate_clients() ]
+		self.assertEqual( len(clients), len(self.p4.run_clients()), "Wrong number of clients" )
+		self.assertEqual( clients[0]['Client'], "TestClient", "Wrong client spec" )
+		
+	def testRunMany( self ):
+		self.p4.connect()
+		self._setClient()
+		
+		testDir = 'test-many'
+		files = self.createFiles(testDir)
+		
+		change = self.p4.fetch_change()
+		change._description = "My Run Many Test"
+		self._doSubmit("Failed to submit the add", change)
+		
+		depotFiles = [ f['depotFile'] for f in self.p4.run_files('...') ]
+		commands = [ ('fstat', f) for f in depotFiles ] + [ ('fstat', '//depot/no-such-file') ]
+		results = self.p4.run_many(commands, connections=3)
+		self.assertEqual( len(results), len(commands), "Expected one result per command" )
+		for c, r in zip(commands[:-1], results):
+			self.assertEqual( r, self.p4.run(*c), "Result differs from run()" )
+		self.assertTrue( isinstance(results[-1], P4.P4Exception), "Expected an exception for the missing file" )
+		
+		# The pool connections are set up like this one
+		self.p4.host = 'run-many-host'
+		info = self.p4.run_many([ ('info',) ])[0][0]
+		self.assertEqual( info['clientHost'], 'run-many-host', "Host was not passed on to the pool" )
+		self.assertEqual( info['clientName'], self.p4.client, "Client was not passed on to the pool" )
+
+		# The pool is kept between calls until the settings change or we disconnect
+		pool = self.p4._P4__many[1]
+		self.p4.run_many([ ('info',) ])
+		self.assertTrue( self.p4._P4__many[1] is pool, "Pool was not reused" )
+		self.assertEqual( pool.idle, 1, "Pool connection was not kept" )
+		self.p4.host = 'another-host'
+		self.p4.run_many([ ('info',) ])
+		self.assertFalse( self.p4._P4__many[1] is pool, "Pool kept after the settings changed" )
+		self.p4.disconnect()
+		self.assertFalse( '_P4__many' in self.p4.__dict__, "Pool kept after disconnect" )
+
+		with P4.Pool(2, port=self.p4.port, user=self.p4.user) as pool:
+			results = pool.run_many([ ('info',) ] * 5)
+			self.assertEqual( len(results), 5, "Expected one result per command" )
+			self.assertEqual( pool.in_use, 0, "Connections were not checked in" )
+		
+	def testRunSharded( self ):
+		self.p4.connect()
+		self._setClient()
+		
+		for testDir in ( 'test-shard-a', 'test-shard-b', 'test-shard-c' ):
+			self.createFiles(testDir)
+		
+		change = self.p4.fetch_change()
+		change._description = "My Sharded Test"
+		self._doSubmit("Failed to submit the add", change)
+		
+		expected = sorted( f['depotFile'] for f in self.p4.run_files('//depot/...') )
+		sharded = [ f['depotFile'] for f in self.p4.run_sharded('files', '//depot/...', connections=2) ]
+		self.assertEqual( sorted(sharded), expected, "Sharded files differ from files" )
+		self.assertEqual( sharded, [ f['depotFile'] for f in self.p4.run_sharded('files', '//depot/...') ],
+			"Sharded results are not in a deterministic order" )
+		
+		fstat = [ f['depotFile'] for f in self.p4.run_sharded('fstat', '//depot/...', '-Ol', maxscanrows=100000) ]
+		self.assertEqual( sorted(fstat), expected, "Sharded fstat differs from files" )
+		
+		everything = [ f['depotFile'] for f in self.p4.run_sharded('files', '//...') ]
+		self.assertEqual( sorted(everything), expected, "Sharding by depot differs from files" )
+
+		# No subdirectories is not an error, and limits apply to unsharded paths too
+		leaf = '//depot/test-shard-a/...'
+		self.assertEqual( len(list(self.p4.run_sharded('files', leaf))), len(self.p4.run_files(leaf)),
+			"Directory without subdirectories" )
+		self.assertRaises( P4.P4Exception, list,
+			self.p4.run_sharded('files', '//depot/test-shard-a/*', maxresults=1) )
+
+	def testRunChunked( self ):
+		self.p4.connect()
+		self._setClient()
+		
+		testDir = 'test-chunked'
+		files = self.createFiles(testDir)
+		
+		opened = self.p4.run_opened(files=(testDir + "/" + f for f in files), chunk=2)
+		self.assertEqual( len(opened), len(files), "Expected one result per file" )
+		
+		change = self.p4.fetch_change()
+		change._description = "My Chunked Test"
+		self._doSubmit("Failed to submit the add", change)
+		
+		depotFiles = [ f['depotFile'] for f in self.p4.run_files('...') ]
+		fstat = self.p4.run('fstat', '-Ol', files=depotFiles, chunk=3)
+		self.assertEqual( [ f['depotFile'] for f in fstat ], depotFiles, "Chunked fstat differs" )
+		self.assertEqual( len(self.p4.run_fstat(files=depotFiles)), len(depotFiles), "Default chunk failed" )
+		self.assertRaises( ValueError, self.p4.run_fstat, '...', chunk=2 )
+		
+	def testInputIterator( self ):
+		self.p4.connect()
+		self._setClient()
+		
+		client = self.p4.fetch_client()
+		client._description = "Description from a generator\n"
+		consumed = []
+		def forms():
+			consumed.append(client)
+			yield client
+		
+		self.p4.input = forms()
+		self.assertEqual( consumed, [], "Input was consumed before it was needed" )
+		self.p4.run_client('-i')
+		self.assertEqual( len(consumed), 1, "Input was not consumed" )
+		self.assertEqual( self.p4.fetch_client()._description, client._description,
+			"Client not saved from iterator input" )
+		
+		client._description = "Description from a tuple\n"
+		self.p4.run_client('-i', input=(client, "unused"))
+		self.assertEqual( self.p4.fetch_client()._description, client._description,
+			"Client not saved from tuple input" )
+
+		# used input is not removed from P4.input
+		answers = [client, "unused"]
+		self.p4.input = answers
+		self.p4.run_client('-i')
+		self.assertEqual( self.p4.input, answers, "Input changed" )
+
+		# an iterator that fails stops the command with its exception
+		def broken():
+			raise ValueError("no form today")
+			yield client
+		self.p4.input = broken()
+		self.assertRaises( ValueError, self.p4.run_client, '-i' )
+		self.assertEqual( self.p4.run_info()[0]['clientName'], self.p4.client, "Connection unusable" )
+		
+	def testOutputBatch( self ):
+		self.p4.connect()
+		self._setClient()
+		
+		testDir = 'test-output-batch'
+		files = self.createFiles(testDir)
+		
+		change = self.p4.fetch_change()
+		change._description = "My Output Batch Test"
+		self._doSubmit("Failed to submit the add", change)
+		
+		class BatchHandler(P4.OutputHandler):
+			def __init__(self):
+				P4.OutputHandler.__init__(self)
+				self.batches = []
+			def outputStatBatch(self, records):
+				self.batches.append(len(records))
+				return P4.OutputHandler.HANDLED
+		
+		self.assertEqual( self.p4.handler_batch_size, 0, "Handler batch size is set by default" )
+		h = BatchHandler()
+		self.p4.handler_batch_size = 2
+		self.assertEqual( self.p4.run_files('...', handler=h), [], "Handled batches were reported" )
+		self.assertEqual( h.batches, [2, 1], "Unexpected batch sizes" )
+		self.p4.handler_batch_size = 0
+
+		# staging records without the GIL leaves the handler batches alone
+		h = BatchHandler()
+		self.p4.run_files('...', handler=h, batch_size=2)
+		self.assertEqual( h.batches, [3], "batch_size changed the handler batches" )
+		
+		class ReportingBatchHandler(P4.OutputHandler):
+			def outputStatBatch(self, records):
+				return P4.OutputHandler.REPORT
+		
+		result = self.p4.run_files('...', handler=ReportingBatchHandler())
+		self.assertEqual( len(result), len(files), "Reported batch is missing records" )
+		
+	def testOutputSinks( self ):
+		self.p4.connect()
+		self._setClient()
+		
+		testDir = 'test-sinks'
+		files = self.createFiles(testDir)
+		
+		change = self.p4.fetch_change()
+		change._description = "My Sink Test"
+		self._doSubmit("Failed to submit the add", change)
+		
+		expected = self.p4.run_fstat('-Ol', '...')
+		
+		count = P4API.CountSink()
+		self.assertEqual( self.p4.run_fstat('...', handler=count), [], "Sink records were reported" )
+		self.assertEqual( count.result, len(expected), "Wrong record count" )
+		count.reset()
+		self.assertEqual( count.result, 0, "Count not reset" )
+		
+		names = P4API.FieldSetSink('depotFile')
+		self.p4.run_fstat('...', handler=names)
+		self.assertEqual( names.result, set( f['depotFile'] for f in expected ), "Wrong field values" )
+		names = P4API.FieldSetSink('depotFile')
+		self.p4.run_fstat('...', handler=names, encoding='raw')
+		self.assertEqual( names.result, set( f['depotFile'].encode() for f in expected ),
+			"Field values ignore the encoding" )
+		
+		total = P4API.SumSink('fileSize')
+		self.p4.run_fstat('-Ol', '...', handler=total)
+		self.assertEqual( total.result, sum( int(f['fileSize']) for f in expected ), "Wrong sum" )
+		total = P4API.SumSink('depotFile')
+		self.p4.run_fstat('...', handler=total)
+		self.assertRaises( ValueError, getattr, total, 'result' )
+		total.reset()
+		self.assertEqual( total.result, 0, "Sum not reset" )
+		
+		import json
+		path = os.path.join(self.client_root, 'fstat.jsonl')
+		jsonl = P4API.JsonlSink(path)
+		self.p4.run_fstat('-Ol', '...', handler=jsonl)
+		self.assertEqual( jsonl.result, len(expected), "Wrong number of lines" )
+		jsonl.close()
+		with open(path) as f:
+			records = [ json.loads(line) for line in f ]
+		self.assertEqual( records, expected, "JSON lines differ from fstat" )
+		
+	def testFieldProjection( self ):
+		self.assertEqual( self.p4.fields, None, "Fields are projected by default" )
+		
+		self.p4.connect()
+		self._setClient()
+		
+		testDir = 'test-fields'
+		files = self.createFiles(testDir)
+		
+		change = self.p4.fetch_change()
+		change._description = "My Projection Test"
+		self._doSubmit("Failed to submit the add", change)
+		
+		wanted = ['depotFile', 'headRev', 'headChange']
+		expected = self.p4.run_fstat('...')
+		projected = self.p4.run_fstat('...', fields=wanted)
+		self.assertEqual( self.p4.fields, None, "Projection was not restored" )
+		self.assertEqual( len(projected), len(expected), "Wrong number of records" )
+		for rec, exp in zip(projected, expected):
+			self.assertEqual( sorted(rec.keys()), sorted(wanted), "Unexpected fields" )
+			self.assertEqual( rec['headRev'], exp['headRev'], "Wrong headRev" )
+
+		# A -T of the caller's own is left alone and still projected
+		own = self.p4.run_fstat('-T', 'depotFile,headRev,headType', '...', fields=['depotFile', 'headType'])
+		self.assertEqual( own, [ { 'depotFile' : f['depotFile'], 'headType' : f['headType'] } for f in expected ],
+			"Caller's -T not projected" )
+
+		# ... and the filter works on what it asks for
+		own = self.p4.run_fstat('-T', 'depotFile,headRev', '...', fields=['depotFile'], filter="headRev == 1")
+		self.assertEqual( own, [ { 'depotFile' : f['depotFile'] } for f in expected ],
+			"Filter on the caller's -T fields failed" )
+		
+		self.p4.fields = ['depotFile']
+		self.assertEqual( self.p4.fields, ['depotFile'], "Wrong fields" )
+		files = self.p4.run_files('...', lazy_records=1)
+		self.assertEqual( [ list(f.keys()) for f in files ], [ ['depotFile'] ] * len(files), "Lazy records not projected" )
+		self.p4.fields = None
+		self.assertRaises( TypeError, setattr, self.p4, 'fields', 42 )
+		
+	def testRecordFilter( self ):
+		self.assertEqual( self.p4.filter, "", "Records are filtered by default" )
+		
+		self.p4.connect()
+		self._setClient()
+		
+		testDir = 'test-filter'
+		files = self.createFiles(testDir)
+		
+		change = self.p4.fetch_change()
+		change._description = "My Filter Test"
+		self._doSubmit("Failed to submit the add", change)
+		
+		self.p4.run_delete(testDir + "/foo.txt")
+		change = self.p4.fetch_change()
+		change._description = "Delete one"
+		self._doSubmit("Failed to submit the delete", change)
+		
+		expected = self.p4.run_fstat('-Ol', '...')
+		def check(expr, predicate):
+			result = self.p4.run_fstat('-Ol', '...', filter=expr)
+			self.assertEqual( result, [ f for f in expected if predicate(f) ], "Wrong records for " + expr )
+		
+		check( "headAction != delete", lambda f: f['headAction'] != 'delete' )
+		check( "headAction == 'delete' or depotFile =~ '*/ba?.txt'", lambda f: True )
+		check( "fileSize > 0 && depotFile ^= //depot/test-filter/b", 
+			lambda f: 'fileSize' in f and int(f['fileSize']) > 0 and f['depotFile'].startswith('//depot/test-filter/b') )
+		check( "not (headRev >= 2) and headTime", lambda f: int(f['headRev']) < 2 )
+		check( "noSuchField == 1", lambda f: False )
+
+		# The filter sees its fields even when fields= projects them away
+		result = self.p4.run_fstat('-Ol', '...', fields=['depotFile'], filter="headAction != delete")
+		self.assertEqual( result, [ { 'depotFile' : f['depotFile'] } for f in expected if f['headAction'] != 'delete' ],
+			"Projection hid the filtered field" )
+		result = self.p4.run_fstat('-Ol', '...', fields=['depotFile'], filter="fileSize > 0")
+		self.assertEqual( result, [ { 'depotFile' : f['depotFile'] } for f in expected if int(f.get('fileSize', 0)) > 0 ],
+			"Projection hid the filtered field" )
+		self.assertEqual( self.p4.filter, "", "Filter was not restored" )
+		
+		self.assertRaises( ValueError, setattr, self.p4, 'filter', "headRev ==" )
+		self.assertRaises( ValueError, setattr, self.p4, 'filter', "(headRev" )
+		
+		# Forms and the specs behind iterate_*() are not filtered
+		self.p4.filter = "fileSize > 0"
+		self.assertEqual( self.p4.fetch_client()['Client'], self.p4.client, "Form was filtered" )
+		self.assertTrue( len(list(self.p4.iterate_clients())) > 0, "Spec list was filtered" )
+		self.p4.filter = ""
+
+	def testTypedValues( self ):
+		self.assertEqual( self.p4.typed, None, "Values are typed by default" )
+		
+		self.p4.connect()
+		self._setClient()
+		
+		testDir = 'test-typed'
+		files = self.createFiles(testDir)
+		
+		change = self.p4.fetch_change()
+		change._description = "My Typed Test"
+		self._doSubmit("Failed to submit the add", change)
+		
+		import datetime
+		expected = self.p4.run_fstat('-Ol', '...')
+		typed = self.p4.run_fstat('-Ol', '...', typed=True)
+		self.assertEqual( self.p4.typed, None, "Typed mode was not restored" )
+		for rec, exp in zip(typed, expected):
+			self.assertEqual( rec['headRev'], int(exp['headRev']), "headRev not converted" )
+			self.assertEqual( rec['fileSize'], int(exp['fileSize']), "fileSize not converted" )
+			self.assertTrue( isinstance(rec['headTime'], datetime.datetime), "headTime not converted" )
+			self.assertEqual( rec['depotFile'], exp['depotFile'], "depotFile changed" )
+		
+		custom = self.p4.run_fstat('-Ol', '...', typed={'headRev': 'str', 'headType': 'int'})
+		self.assertEqual( custom[0]['headRev'], expected[0]['headRev'], "Override to str ignored" )
+		self.assertEqual( custom[0]['headType'], expected[0]['headType'], "Non-integer value was not kept" )
+		self.assertEqual( custom[0]['headChange'], int(expected[0]['headChange']), "Built-in table not applied" )
+		self.assertRaises( ValueError, setattr, self.p4, 'typed', {'headRev': 'float'} )
+		
+		self.p4.typed = True
+		log = self.p4.run_filelog(testDir + "/...")
+		self.assertEqual( log[0].revisions[0].rev, 1, "Wrong filelog revision" )
+		self.assertTrue( isinstance(log[0].revisions[0].time, datetime.datetime), "Wrong filelog time" )
+
+		# the default changelist is not a number and stays a string
+		self.p4.run_edit(files[0])
+		self.assertEqual( self.p4.run_opened()[0]['change'], 'default', "Default change was converted" )
+		self.p4.run_revert(files[0])
+		self.p4.typed = None
+		
+	def testRunIter( self ):
+		self.p4.connect()
+		self._setClient()
+		
+		testDir = 'test-iter'
+		files = self.createFiles(testDir)
+		
+		change = self.p4.fetch_change()
+		change._description = "My Iterator Test"
+		self._doSubmit("Failed to submit the add", change)
+		
+		expected = [ f['depotFile'] for f in self.p4.run_files('...') ]
+		streamed = [ f['depotFile'] for f in self.p4.run_iter('files', '...') ]
+		self.assertEqual( streamed, expected, "run_iter returned different results" )
+		
+		# abandoning the iteration stops the command and frees the connection
+		results = self.p4.run_iter('fstat', '...')
+		self.assertTrue( 'depotFile' in next(results), "Unexpected fstat result" )
+		results.close()
+		self.assertEqual( len(self.p4.run_files('...')), len(files), "Connection unusable after closing run_iter" )
+		
+		# warnings are raised at the end of the iteration
+		self.assertRaises( P4.P4Exception, list, self.p4.run_iter('files', 'nonexistent/...') )
+		self.assertEqual( len(self.p4.warnings), 1, "Expected one warning" )
+
+	def testRunAsync( self ):
+		if sys.version_info < (3,7):
+			self.skipTest( "run_async() needs Python 3.7" )
+		
+		import asyncio
+		
+		self.p4.connect()
+		loop = asyncio.new_event_loop()
+		try:
+			info = loop.run_until_complete( self.p4.run_async('info', loop=loop) )
+			self.assertEqual( len(info), 1, "Unexpected result from run_async" )
+			self.assertTrue( 'serverRoot' in info[0], "run_async did not return tagged output" )
+			
+			untagged = loop.run_until_complete( self.p4.run_async('info', tagged=False, loop=loop) )
+			self.assertTrue( isinstance(untagged[0], str), "Keyword arguments were not applied" )
+			self.assertTrue( self.p4.tagged, "Keyword arguments were not restored" )
+			
+			future = self.p4.run_async('files', 'nonexistent/...', loop=loop)
+			self.assertRaises( P4.P4Exception, loop.run_until_complete, future )
+			
+			# the connection is free again once the future is done
+			self.assertEqual( len(self.p4.run_info()), 1, "Connection unusable after run_async" )
+
+			# without loop= the future belongs to the running loop
+			futures = []
+			loop.call_soon( lambda: futures.append(self.p4.run_async('info', tagged=False)) )
+			loop.run_until_complete( asyncio.sleep(0) )
+			self.assertTrue( isinstance(loop.run_until_complete(futures[0])[0], str),
+				"run_async did not use the running loop" )
+			self.assertTrue( self.p4.tagged, "Keyword arguments were not restored" )
+
+			# a command cut short by disconnect() does not look finished
+			future = self.p4.run_async('info', loop=loop)
+			self.p4.disconnect()
+			self.assertRaises( P4.P4Exception, loop.run_until_complete, future )
+		finally:
+			loop.close()
+
 	if False: # test currently disabled
 		def testProgress( self ):
 			self.p4.connect()
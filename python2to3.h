@@ -56,6 +56,13 @@ inline bool IsString(PyObject *obj) {
 
 const char * GetPythonString(PyObject *obj);
 
+inline PyObject * CreateInternedPythonString(const char * text, size_t len) {
+    PyObject * s = PyUnicode_FromStringAndSize(text, len);
+    if( s )
+	PyUnicode_InternInPlace(&s);
+    return s;
+}
+
 #else
 
 #define StringType PyString_Type
@@ -76,8 +83,29 @@ inline const char * GetPythonString(PyObject *obj) {
     return PyBytes_AsString(obj);
 }
 
+inline PyObject * CreateInternedPythonString(const char * text, size_t len) {
+    PyObject * s = PyString_FromStringAndSize(text, len);
+    if( s )
+	PyString_InternInPlace(&s);
+    return s;
+}
+
 
 #endif // PY_MAJOR_VERSION
 
+// Calls a callable with a single argument, through vectorcall where the
+// interpreter has it, which avoids building an argument tuple.
+
+inline PyObject * CallWithOneArg(PyObject * callable, PyObject * arg) {
+#if PY_VERSION_HEX >= 0x03090000
+    return PyObject_CallOneArg(callable, arg);
+#elif PY_VERSION_HEX >= 0x03080000
+    PyObject * args[ 1 ] = { arg };
+    return _PyObject_Vectorcall(callable, args, 1, NULL);
+#else
+    return PyObject_CallFunctionObjArgs(callable, arg, NULL);
+#endif
+}
+
 #endif // PYTHON2TO3_H
  
@@ -373,7 +373,10 @@ def do_setup(p4_api_dir, ssl):
                                             "P4Result.cpp",
                                             "PythonMergeData.cpp", "P4MapMaker.cpp",
                                             "PythonSpecData.cpp", "PythonMessage.cpp",
-                                            "PythonActionMergeData.cpp", "PythonClientProgress.cpp"],
+                                            "PythonActionMergeData.cpp", "PythonClientProgress.cpp",
+                                            "PythonConnectionPool.cpp", "PythonResultStream.cpp",
+                                            "PythonRecord.cpp", "PythonOutputSink.cpp",
+                                            "P4RecordFilter.cpp"],
                          include_dirs = inc_path,
                          library_dirs = lib_path,
                          libraries = info.libraries,